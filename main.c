@@ -1,8 +1,12 @@
+#define _GNU_SOURCE // strcasestr
 #include <assert.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define MAX_ENTRIES_N 100
 
@@ -27,363 +31,3432 @@ bool str_eq(const char *a, const char *b) {
   }
 }
 
+/*
+ * Pattern literals.
+ *
+ * Besides plain substrings, a search literal may be:
+ *   ^prefix     - entry must start with the text,
+ *   suffix$     - entry must end with the text,
+ *   wi*ld?card  - '*' matches any run of characters, '?' exactly one,
+ *   /re(gex)+/  - a regex subset: concatenation, '|', '()', '*', '+', '?',
+ *                 '.', '[a-z]' / '[^a-z]' classes and '\' escapes; '^' and
+ *                 '$' are only allowed at the ends of the regex.
+ * All of them compile to a Thompson NFA which is determinized lazily while
+ * matching, so a match is linear in the length of the entry and never
+ * backtracks. Matching is case-insensitive, like the substring search.
+ */
+
+#define DFA_CACHE_MAX_STATES 64
+#define REGEX_MAX_DEPTH 100 // groups are parsed recursively
+
 typedef enum {
-  TOKEN_TYPE_STR,
-  TOKEN_TYPE_OP_OR,
-  TOKEN_TYPE_OP_AND,
-  TOKEN_TYPE_OP_NOT,
-  TOKEN_TYPE_PAR_OPEN,
-  TOKEN_TYPE_PAR_CLOSE,
-  TOKEN_TYPE_TRUE,
-  TOKEN_TYPE_FALSE,
-} TokenType;
+  NFA_STATE_CHARS,
+  NFA_STATE_SPLIT,
+  NFA_STATE_EPSILON,
+  NFA_STATE_MATCH,
+} NfaStateType;
 
 typedef struct {
-  TokenType type;
-  char *str;
-} Token;
+  NfaStateType type;
+  unsigned char chars[32]; // bitset of (lowercased) bytes for NFA_STATE_CHARS
+  int out;
+  int out1; // second branch of NFA_STATE_SPLIT
+} NfaState;
 
 typedef struct {
-  size_t tokens_n;
-  Token *tokens;
-} TokenList;
+  int *nfa_states; // sorted ids of CHARS and MATCH states
+  size_t nfa_states_n;
+  bool is_match;
+  int next[256]; // -1 means the transition has not been computed yet
+} DfaState;
 
-TokenList *token_list_init(void) {
-  TokenList *token_list = malloc(sizeof(TokenList));
-  if (token_list == NULL) {
-    return NULL;
-  }
-  token_list->tokens_n = 0;
-  token_list->tokens = NULL;
-  return token_list;
+typedef struct {
+  NfaState *states;
+  size_t states_n;
+  size_t states_cap;
+  int start;
+  bool anchored_start;
+  bool anchored_end;
+  // a substring every matching entry contains, used as a cheap pre-filter
+  char *required;
+
+  // lazily built DFA, flushed when DFA_CACHE_MAX_STATES is reached
+  DfaState *dfa_states;
+  size_t dfa_states_n;
+  int dfa_start;
+  bool *closure_marks;
+  int *closure_stack;
+  int *closure_set;
+} Pattern;
+
+typedef struct {
+  int start;
+  int end; // always an NFA_STATE_EPSILON with a dangling out
+} NfaFragment;
+
+void charset_add(unsigned char *set, unsigned char c) {
+  c = tolower(c);
+  set[c / 8] |= 1 << (c % 8);
 }
 
-void token_list_destroy_shallow(TokenList *token_list) {
-  if (token_list == NULL) {
-    return;
-  }
-  free(token_list->tokens);
-  token_list->tokens = NULL;
-  free(token_list);
+bool charset_has(const unsigned char *set, unsigned char c) {
+  return (set[c / 8] & (1 << (c % 8))) != 0;
 }
 
-void token_list_destroy_deep(TokenList *token_list) {
-  if (token_list == NULL) {
-    return;
-  }
-  for (size_t i = 0; i < token_list->tokens_n; i++) {
-    if (token_list->tokens[i].type == TOKEN_TYPE_STR) {
-      free(token_list->tokens[i].str);
-      token_list->tokens[i].str = NULL;
+int nfa_add_state(Pattern *p, NfaStateType type) {
+  if (p->states_n == p->states_cap) {
+    size_t new_cap = p->states_cap == 0 ? 16 : p->states_cap * 2;
+    NfaState *new_states = realloc(p->states, new_cap * sizeof(NfaState));
+    if (new_states == NULL) {
+      return -1;
     }
+    p->states = new_states;
+    p->states_cap = new_cap;
   }
-  token_list_destroy_shallow(token_list);
+  NfaState *state = &p->states[p->states_n];
+  memset(state, 0, sizeof(NfaState));
+  state->type = type;
+  state->out = -1;
+  state->out1 = -1;
+  return p->states_n++;
 }
 
-Token token_list_peek(TokenList *token_list) {
-  assert(token_list->tokens_n != 0);
-  return token_list->tokens[token_list->tokens_n - 1];
+bool nfa_fragment_empty(Pattern *p, NfaFragment *result) {
+  int s = nfa_add_state(p, NFA_STATE_EPSILON);
+  if (s < 0) {
+    return false;
+  }
+  *result = (NfaFragment){.start = s, .end = s};
+  return true;
 }
 
-void token_list_drop_last_element(TokenList *token_list) {
-  assert(token_list->tokens_n != 0);
-  memset(&token_list->tokens[--token_list->tokens_n], 0, sizeof(Token));
+// chars may be NULL for "any character but NUL"
+bool nfa_fragment_chars(Pattern *p, const unsigned char *chars,
+                        NfaFragment *result) {
+  int s = nfa_add_state(p, NFA_STATE_CHARS);
+  int e = nfa_add_state(p, NFA_STATE_EPSILON);
+  if (s < 0 || e < 0) {
+    return false;
+  }
+  if (chars != NULL) {
+    memcpy(p->states[s].chars, chars, sizeof(p->states[s].chars));
+  } else {
+    memset(p->states[s].chars, 0xff, sizeof(p->states[s].chars));
+    p->states[s].chars[0] &= ~1;
+  }
+  p->states[s].out = e;
+  *result = (NfaFragment){.start = s, .end = e};
+  return true;
 }
 
-Token token_list_pop(TokenList *token_list) {
-  Token result = token_list_peek(token_list);
-  token_list_drop_last_element(token_list);
-  return result;
+bool nfa_fragment_char(Pattern *p, unsigned char c, NfaFragment *result) {
+  unsigned char chars[32] = {0};
+  charset_add(chars, c);
+  return nfa_fragment_chars(p, chars, result);
 }
 
-void token_list_push(TokenList *token_list, Token new_token) {
-  token_list->tokens[token_list->tokens_n++] = new_token;
+void nfa_concat(Pattern *p, NfaFragment *a, NfaFragment b) {
+  p->states[a->end].out = b.start;
+  a->end = b.end;
 }
 
-TokenList *tokenize(const char *s) {
-  // This treats whitespace after a word as a part of a token
-  TokenList *result = token_list_init();
-  if (result == NULL) {
-    fprintf(stderr, "Failed to allocate memory for token list!\n");
-    return NULL;
-  }
-  while (*s != '\0') {
-    if (*s == ' ') {
-      // dealing with the "leftmost" whitespaces, not belonging
-      // to any token
-      s++;
-      continue;
-    }
-
-    const size_t resize_block_size = 10;
-    if (result->tokens_n % resize_block_size == 0) {
-      result->tokens =
-          realloc(result->tokens,
-                  (result->tokens_n + resize_block_size) * sizeof(Token));
-    }
-
-    switch (*s) {
-    case '|':
-      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_OR, .str = NULL});
-      s++;
-      break;
-    case '&':
-      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_AND, .str = NULL});
-      s++;
-      break;
-    case '!':
-      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_NOT, .str = NULL});
-      s++;
-      break;
-    case '(':
-      token_list_push(result,
-                      (Token){.type = TOKEN_TYPE_PAR_OPEN, .str = NULL});
-      s++;
-      break;
-    case ')':
-      token_list_push(result,
-                      (Token){.type = TOKEN_TYPE_PAR_CLOSE, .str = NULL});
-      s++;
-      break;
-    default: {
-      size_t token_str_len_with_right_spaces = strcspn(s, "|&()!");
-      assert(token_str_len_with_right_spaces != 0);
-
-      int token_str_len_trimmed = token_str_len_with_right_spaces;
-      while (token_str_len_trimmed > 0 && s[token_str_len_trimmed - 1] == ' ') {
-        token_str_len_trimmed--;
-      }
-
-      char *token_str = NULL;
-      if (token_str_len_trimmed != 0) {
-        token_str = strndup(s, token_str_len_trimmed);
-        if (token_str == NULL) {
-          fprintf(stderr, "Failed to allocate memory for token! %s\n", s);
-          token_list_destroy_deep(result);
-          return NULL;
-        }
-      }
-      token_list_push(result,
-                      (Token){.type = TOKEN_TYPE_STR, .str = token_str});
-      s += token_str_len_with_right_spaces;
-    }
-    }
+bool nfa_alternate(Pattern *p, NfaFragment *a, NfaFragment b) {
+  int s = nfa_add_state(p, NFA_STATE_SPLIT);
+  int e = nfa_add_state(p, NFA_STATE_EPSILON);
+  if (s < 0 || e < 0) {
+    return false;
   }
-  return result;
+  p->states[s].out = a->start;
+  p->states[s].out1 = b.start;
+  p->states[a->end].out = e;
+  p->states[b.end].out = e;
+  *a = (NfaFragment){.start = s, .end = e};
+  return true;
 }
 
-int precedence(TokenType type) {
-  switch (type) {
-  case TOKEN_TYPE_OP_OR:
-    return 1;
-  case TOKEN_TYPE_OP_AND:
-    return 2;
-  case TOKEN_TYPE_OP_NOT:
-    return 3;
+// quantifier is one of '*', '+', '?'
+bool nfa_repeat(Pattern *p, NfaFragment *a, char quantifier) {
+  int s = nfa_add_state(p, NFA_STATE_SPLIT);
+  int e = nfa_add_state(p, NFA_STATE_EPSILON);
+  if (s < 0 || e < 0) {
+    return false;
+  }
+  p->states[s].out = a->start;
+  p->states[s].out1 = e;
+  switch (quantifier) {
+  case '*':
+    p->states[a->end].out = s;
+    *a = (NfaFragment){.start = s, .end = e};
+    break;
+  case '+':
+    p->states[a->end].out = s;
+    *a = (NfaFragment){.start = a->start, .end = e};
+    break;
   default:
-    return 0;
+    p->states[a->end].out = e;
+    *a = (NfaFragment){.start = s, .end = e};
   }
+  return true;
 }
 
-TokenList *to_postfix_notation(const TokenList *const token_list) {
-  TokenList *output_queue = token_list_init();
-  if (output_queue == NULL) {
-    fprintf(stderr, "Failed to allocate memory for output queue!\n");
-    return NULL;
+// Puts ".*" before (or after) the fragment
+bool nfa_unanchor(Pattern *p, NfaFragment *a, bool before) {
+  NfaFragment any;
+  if (!nfa_fragment_chars(p, NULL, &any) || !nfa_repeat(p, &any, '*')) {
+    return false;
   }
-  TokenList *op_stack = token_list_init();
-  if (op_stack == NULL) {
-    fprintf(stderr, "Failed to allocate memory for op stack!\n");
-    goto clean_up_err;
+  if (before) {
+    nfa_concat(p, &any, *a);
+    *a = any;
+  } else {
+    nfa_concat(p, a, any);
   }
+  return true;
+}
 
-  // allocating maximum possible sizes
-  output_queue->tokens = calloc(token_list->tokens_n, sizeof(Token));
-  if (output_queue->tokens == NULL) {
-    fprintf(stderr, "Failed to allocate memory for output queue tokens!\n");
-    goto clean_up_err;
-  }
-  op_stack->tokens = calloc(token_list->tokens_n, sizeof(Token));
-  if (op_stack->tokens == NULL) {
-    fprintf(stderr, "Failed to allocate memory for op stack tokens!\n");
-    goto clean_up_err;
+/*
+ * Tracks the longest run of literal characters that every match has to
+ * contain. Only the top level of the pattern is considered: anything
+ * inside a group, a class or under a quantifier ends the current run.
+ */
+typedef struct {
+  char *run;
+  size_t run_n;
+  char *best;
+  size_t best_n;
+} RequiredSubstring;
+
+void required_substring_flush(RequiredSubstring *rs) {
+  if (rs->run_n > rs->best_n) {
+    memcpy(rs->best, rs->run, rs->run_n);
+    rs->best_n = rs->run_n;
+    rs->best[rs->best_n] = '\0';
   }
+  rs->run_n = 0;
+}
 
-  for (size_t i = 0; i < token_list->tokens_n; i++) {
-    Token current_tok = token_list->tokens[i];
-    switch (current_tok.type) {
-    case TOKEN_TYPE_STR:
-      token_list_push(output_queue, current_tok);
-      break;
-    case TOKEN_TYPE_OP_OR:
-    case TOKEN_TYPE_OP_NOT:
-    case TOKEN_TYPE_OP_AND: {
-      while (op_stack->tokens_n != 0) {
-        Token stack_op = token_list_peek(op_stack);
-        if (stack_op.type == TOKEN_TYPE_PAR_OPEN) {
-          break;
-        }
+typedef struct {
+  Pattern *pattern;
+  const char *s;
+  const char *end;
+  int depth;
+  bool top_level_alternation;
+  RequiredSubstring required;
+  const char *error;
+} RegexParser;
 
-        int current_tok_prec = precedence(current_tok.type);
-        int stack_op_prec = precedence(stack_op.type);
+bool regex_parse_alternation(RegexParser *parser, NfaFragment *result);
 
-        if (!(stack_op_prec > current_tok_prec ||
-              (stack_op_prec == current_tok_prec &&
-               current_tok.type != TOKEN_TYPE_OP_NOT))) {
-          break;
-        }
-        // add to queue
-        token_list_push(output_queue, stack_op);
-        token_list_drop_last_element(op_stack);
-      }
-      // o1 to stack
-      token_list_push(op_stack, current_tok);
-      break;
+bool regex_parse_class(RegexParser *parser, NfaFragment *result) {
+  // parser->s points right after '['
+  bool negated = false;
+  if (parser->s < parser->end && *parser->s == '^') {
+    negated = true;
+    parser->s++;
+  }
+  unsigned char chars[32] = {0};
+  bool first = true;
+  while (parser->s < parser->end && (*parser->s != ']' || first)) {
+    first = false;
+    unsigned char lo = *parser->s++;
+    if (lo == '\\' && parser->s < parser->end) {
+      lo = *parser->s++;
     }
-    case TOKEN_TYPE_PAR_OPEN:
-      // push to stack
-      token_list_push(op_stack, current_tok);
-      break;
-    case TOKEN_TYPE_PAR_CLOSE: {
-      while (op_stack->tokens_n != 0) {
-        Token op_from_stack = token_list_peek(op_stack);
-        if (op_from_stack.type == TOKEN_TYPE_PAR_OPEN) {
-          break;
-        }
-        // from stack to queue
-        token_list_push(output_queue, op_from_stack);
-        token_list_drop_last_element(op_stack);
+    unsigned char hi = lo;
+    if (parser->s + 1 < parser->end && *parser->s == '-' &&
+        parser->s[1] != ']') {
+      parser->s++;
+      hi = *parser->s++;
+      if (hi == '\\' && parser->s < parser->end) {
+        hi = *parser->s++;
       }
-      if (op_stack->tokens_n == 0 ||
-          token_list_peek(op_stack).type != TOKEN_TYPE_PAR_OPEN) {
-        fprintf(stderr, "Mismatched parentheses (while processing tokens)!\n");
-        goto clean_up_err;
+      if (hi < lo) {
+        parser->error = "Inverted character class range";
+        return false;
       }
-      token_list_drop_last_element(op_stack); // drop '('
-      /* we don't need function-before-( -- so just skipping it */
-      break;
     }
-    case TOKEN_TYPE_TRUE:
-    case TOKEN_TYPE_FALSE:
-      break;
+    for (int c = lo; c <= hi; c++) {
+      charset_add(chars, c);
     }
   }
-
-  // going backwards, should know negative numbers :)
-  for (int i = op_stack->tokens_n - 1; i >= 0; --i) {
-    if (op_stack->tokens[i].type == TOKEN_TYPE_PAR_OPEN) {
-      fprintf(stderr, "Mismatched parentheses (while building output)!\n");
-      goto clean_up_err;
+  if (parser->s == parser->end) {
+    parser->error = "Unterminated character class";
+    return false;
+  }
+  parser->s++; // skip ']'
+  if (negated) {
+    unsigned char positive[32];
+    memcpy(positive, chars, sizeof(chars));
+    memset(chars, 0, sizeof(chars));
+    for (int c = 1; c < 256; c++) {
+      if (!charset_has(positive, c)) {
+        chars[c / 8] |= 1 << (c % 8);
+      }
     }
-    token_list_push(output_queue, op_stack->tokens[i]);
   }
-
-  token_list_destroy_shallow(op_stack);
-  return output_queue;
-
-clean_up_err:
-  token_list_destroy_shallow(output_queue);
-  token_list_destroy_shallow(op_stack);
-  return NULL;
+  return nfa_fragment_chars(parser->pattern, chars, result);
 }
 
-bool eval_postfixed_tokens_as_predicate(const TokenList *const pf_list,
-                                        const char *str) {
-  if (pf_list == NULL) {
-    fprintf(stderr, "NULL postfix list!\n");
-    return false;
+bool regex_parse_atom(RegexParser *parser, NfaFragment *result,
+                      bool *is_required_literal) {
+  *is_required_literal = false;
+  char c = *parser->s++;
+  switch (c) {
+  case '(': {
+    if (parser->depth == REGEX_MAX_DEPTH) {
+      parser->error = "Regex nested too deeply";
+      return false;
+    }
+    parser->depth++;
+    if (!regex_parse_alternation(parser, result)) {
+      return false;
+    }
+    if (parser->s == parser->end || *parser->s != ')') {
+      parser->error = "Mismatched parentheses in regex";
+      return false;
+    }
+    parser->s++;
+    parser->depth--;
+    return true;
   }
-  if (pf_list->tokens_n == 1) {
-    if (pf_list->tokens[0].type != TOKEN_TYPE_STR) {
-      fprintf(stderr, "Not a valid search pattern\n");
+  case '[':
+    return regex_parse_class(parser, result);
+  case '.':
+    return nfa_fragment_chars(parser->pattern, NULL, result);
+  case '*':
+  case '+':
+  case '?':
+    parser->error = "Quantifier without anything to repeat";
+    return false;
+  case '^':
+  case '$':
+    parser->error =
+        "Anchors are only supported at the ends of top-level regex branches";
+    return false;
+  case '\\':
+    if (parser->s == parser->end) {
+      parser->error = "Trailing backslash in regex";
       return false;
     }
-    return strcasestr(str, pf_list->tokens[0].str) != NULL;
+    c = *parser->s++;
+    // fall through
+  default:
+    if (parser->depth == 0) {
+      parser->required.run[parser->required.run_n++] = c;
+      *is_required_literal = true;
+    }
+    return nfa_fragment_char(parser->pattern, c, result);
   }
+}
 
-  TokenList *stack = token_list_init();
-  if (stack == NULL) {
-    fprintf(stderr, "Failed to allocate memory for stack!\n");
-    goto cleanup;
+// At the top level a leading '^' and a trailing '$' set *anchored_start
+// and *anchored_end
+bool regex_parse_concatenation(RegexParser *parser, NfaFragment *result,
+                               bool *anchored_start, bool *anchored_end) {
+  if (!nfa_fragment_empty(parser->pattern, result)) {
+    return false;
   }
-
-  // allocating maximum possible size
-  stack->tokens = calloc(pf_list->tokens_n, sizeof(Token));
-  if (stack->tokens == NULL) {
-    fprintf(stderr, "Failed to allocate memory for stack tokens!\n");
+  if (parser->depth == 0 && parser->s < parser->end && *parser->s == '^') {
+    *anchored_start = true;
+    parser->s++;
+  }
+  while (parser->s < parser->end && *parser->s != '|' && *parser->s != ')') {
+    if (parser->depth == 0 && *parser->s == '$' &&
+        (parser->s + 1 == parser->end || parser->s[1] == '|')) {
+      *anchored_end = true;
+      parser->s++;
+      break;
+    }
+    NfaFragment atom;
+    bool is_required_literal;
+    if (!regex_parse_atom(parser, &atom, &is_required_literal)) {
+      return false;
+    }
+    if (parser->depth == 0 && !is_required_literal) {
+      required_substring_flush(&parser->required);
+    }
+    bool is_quantified = false;
+    bool is_optional = false;
+    while (parser->s < parser->end &&
+           (*parser->s == '*' || *parser->s == '+' || *parser->s == '?')) {
+      char quantifier = *parser->s++;
+      is_quantified = true;
+      is_optional = is_optional || quantifier != '+';
+      if (!nfa_repeat(parser->pattern, &atom, quantifier)) {
+        return false;
+      }
+    }
+    if (is_required_literal && is_quantified) {
+      // "ab*" and "ab+?" only require "a", "ab+" requires "ab" and
+      // nothing after it
+      if (is_optional) {
+        parser->required.run_n--;
+      }
+      required_substring_flush(&parser->required);
+    }
+    nfa_concat(parser->pattern, result, atom);
+  }
+  return true;
+}
+
+/*
+ * Top-level branches are anchored separately: once one of them is anchored
+ * at an end, the whole regex is, and the branches that are not match any
+ * text there instead, e.g. "^a|b" runs as "^(a|.*b)".
+ */
+bool regex_parse_alternation(RegexParser *parser, NfaFragment *result) {
+  Pattern *p = parser->pattern;
+  bool anchored_start = false;
+  bool anchored_end = false;
+  if (!regex_parse_concatenation(parser, result, &anchored_start,
+                                 &anchored_end)) {
+    return false;
+  }
+  while (parser->s < parser->end && *parser->s == '|') {
+    parser->s++;
+    if (parser->depth == 0) {
+      parser->top_level_alternation = true;
+    }
+    NfaFragment alternative;
+    bool alternative_anchored_start = false;
+    bool alternative_anchored_end = false;
+    if (!regex_parse_concatenation(parser, &alternative,
+                                   &alternative_anchored_start,
+                                   &alternative_anchored_end)) {
+      return false;
+    }
+    if (anchored_start != alternative_anchored_start &&
+        !nfa_unanchor(p, anchored_start ? &alternative : result, true)) {
+      return false;
+    }
+    if (anchored_end != alternative_anchored_end &&
+        !nfa_unanchor(p, anchored_end ? &alternative : result, false)) {
+      return false;
+    }
+    anchored_start = anchored_start || alternative_anchored_start;
+    anchored_end = anchored_end || alternative_anchored_end;
+    if (!nfa_alternate(p, result, alternative)) {
+      return false;
+    }
+  }
+  if (parser->depth == 0) {
+    p->anchored_start = anchored_start;
+    p->anchored_end = anchored_end;
+  }
+  return true;
+}
+
+// '\' only escapes the glob metacharacters, before anything else it is
+// a literal backslash (e.g. "C:\Users")
+bool is_glob_escape(const char *s) {
+  return s[0] == '\\' && s[1] != '\0' && strchr("*?\\^$", s[1]) != NULL;
+}
+
+// '^' and '$' are stripped off by the caller
+bool glob_compile(Pattern *p, const char *s, const char *end,
+                  RequiredSubstring *required, NfaFragment *result) {
+  if (!nfa_fragment_empty(p, result)) {
+    return false;
+  }
+  while (s < end) {
+    NfaFragment atom;
+    char c = *s++;
+    if (c == '*' || c == '?') {
+      required_substring_flush(required);
+      if (!nfa_fragment_chars(p, NULL, &atom) ||
+          (c == '*' && !nfa_repeat(p, &atom, '*'))) {
+        return false;
+      }
+    } else {
+      if (c == '\\' && s < end && is_glob_escape(s - 1)) {
+        c = *s++;
+      }
+      required->run[required->run_n++] = c;
+      if (!nfa_fragment_char(p, c, &atom)) {
+        return false;
+      }
+    }
+    nfa_concat(p, result, atom);
+  }
+  return true;
+}
+
+bool is_regex_literal(const char *literal) {
+  size_t len = strlen(literal);
+  return len >= 2 && literal[0] == '/' && literal[len - 1] == '/';
+}
+
+// true when the literal has an unescaped metacharacter
+bool is_pattern_literal(const char *literal) {
+  if (is_regex_literal(literal) || literal[0] == '^') {
+    return true;
+  }
+  for (const char *s = literal; *s != '\0'; s++) {
+    if (is_glob_escape(s)) {
+      s++;
+    } else if (*s == '*' || *s == '?' || (*s == '$' && s[1] == '\0')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drops the '\' of escaped metacharacters from a plain literal
+void literal_unescape(char *literal) {
+  char *out = literal;
+  for (const char *s = literal; *s != '\0'; s++) {
+    if (is_glob_escape(s)) {
+      s++;
+    }
+    *out++ = *s;
+  }
+  *out = '\0';
+}
+
+// true when the character at s[i] is preceded by an odd number of '\'
+bool is_escaped(const char *s, size_t i) {
+  size_t backslashes = 0;
+  while (i > backslashes && s[i - backslashes - 1] == '\\') {
+    backslashes++;
+  }
+  return backslashes % 2 == 1;
+}
+
+void pattern_destroy(Pattern *p) {
+  if (p == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < p->dfa_states_n; i++) {
+    free(p->dfa_states[i].nfa_states);
+  }
+  free(p->dfa_states);
+  free(p->closure_marks);
+  free(p->closure_stack);
+  free(p->closure_set);
+  free(p->required);
+  free(p->states);
+  free(p);
+}
+
+/*
+ * Compiles a pattern literal (see is_pattern_literal). On failure returns
+ * NULL and, if the literal itself is malformed, points *error to the reason.
+ */
+Pattern *pattern_compile(const char *literal, const char **error) {
+  *error = NULL;
+  Pattern *p = calloc(1, sizeof(Pattern));
+  if (p == NULL) {
+    return NULL;
+  }
+  p->dfa_start = -1;
+
+  size_t len = strlen(literal);
+  bool is_regex = is_regex_literal(literal);
+  const char *s = literal;
+  const char *end = literal + len;
+  if (is_regex) {
+    s++;
+    end--;
+  }
+  // a regex parser handles the anchors of each top-level branch
+  if (!is_regex && s < end && *s == '^') {
+    p->anchored_start = true;
+    s++;
+  }
+  if (!is_regex && s < end && end[-1] == '$' &&
+      !is_escaped(literal, end - 1 - literal)) {
+    p->anchored_end = true;
+    end--;
+  }
+
+  RequiredSubstring required = {
+      .run = malloc(len + 1), .run_n = 0, .best = malloc(len + 1), .best_n = 0};
+  if (required.run == NULL || required.best == NULL) {
+    goto clean_up_err;
+  }
+
+  NfaFragment fragment;
+  if (is_regex) {
+    RegexParser parser = {.pattern = p,
+                          .s = s,
+                          .end = end,
+                          .depth = 0,
+                          .top_level_alternation = false,
+                          .required = required,
+                          .error = NULL};
+    bool ok = regex_parse_alternation(&parser, &fragment);
+    if (ok && parser.s != parser.end) {
+      parser.error = "Mismatched parentheses in regex";
+      ok = false;
+    }
+    if (!ok) {
+      *error = parser.error;
+      goto clean_up_err;
+    }
+    required_substring_flush(&parser.required);
+    if (parser.top_level_alternation) {
+      parser.required.best_n = 0;
+    }
+    required = parser.required;
+  } else {
+    if (!glob_compile(p, s, end, &required, &fragment)) {
+      goto clean_up_err;
+    }
+    required_substring_flush(&required);
+  }
+
+  int match = nfa_add_state(p, NFA_STATE_MATCH);
+  if (match < 0) {
+    goto clean_up_err;
+  }
+  p->states[fragment.end].out = match;
+  p->start = fragment.start;
+
+  free(required.run);
+  if (required.best_n != 0) {
+    p->required = required.best;
+  } else {
+    free(required.best);
+  }
+
+  p->closure_marks = malloc(p->states_n * sizeof(bool));
+  p->closure_stack = malloc((p->states_n * 2 + 1) * sizeof(int));
+  p->closure_set = malloc(p->states_n * sizeof(int));
+  p->dfa_states = malloc(DFA_CACHE_MAX_STATES * sizeof(DfaState));
+  if (p->closure_marks == NULL || p->closure_stack == NULL ||
+      p->closure_set == NULL || p->dfa_states == NULL) {
+    pattern_destroy(p);
+    return NULL;
+  }
+  return p;
+
+clean_up_err:
+  free(required.run);
+  free(required.best);
+  pattern_destroy(p);
+  return NULL;
+}
+
+void nfa_closure_add(Pattern *p, int state, size_t *stack_n) {
+  p->closure_stack[(*stack_n)++] = state;
+  while (*stack_n != 0) {
+    int s = p->closure_stack[--(*stack_n)];
+    if (s < 0 || p->closure_marks[s]) {
+      continue;
+    }
+    p->closure_marks[s] = true;
+    if (p->states[s].type == NFA_STATE_EPSILON) {
+      p->closure_stack[(*stack_n)++] = p->states[s].out;
+    } else if (p->states[s].type == NFA_STATE_SPLIT) {
+      p->closure_stack[(*stack_n)++] = p->states[s].out;
+      p->closure_stack[(*stack_n)++] = p->states[s].out1;
+    }
+  }
+}
+
+// Turns the marks into a sorted set in closure_set, returns its size
+size_t nfa_closure_collect(Pattern *p) {
+  size_t n = 0;
+  for (size_t i = 0; i < p->states_n; i++) {
+    if (p->closure_marks[i] && (p->states[i].type == NFA_STATE_CHARS ||
+                                p->states[i].type == NFA_STATE_MATCH)) {
+      p->closure_set[n++] = i;
+    }
+  }
+  return n;
+}
+
+void dfa_cache_flush(Pattern *p) {
+  for (size_t i = 0; i < p->dfa_states_n; i++) {
+    free(p->dfa_states[i].nfa_states);
+  }
+  p->dfa_states_n = 0;
+  p->dfa_start = -1;
+}
+
+// Returns the DFA state for closure_set[0..n), adding it if needed, or -1
+int dfa_find_or_add(Pattern *p, size_t n) {
+  for (size_t i = 0; i < p->dfa_states_n; i++) {
+    DfaState *d = &p->dfa_states[i];
+    if (d->nfa_states_n == n &&
+        memcmp(d->nfa_states, p->closure_set, n * sizeof(int)) == 0) {
+      return i;
+    }
+  }
+  if (p->dfa_states_n == DFA_CACHE_MAX_STATES) {
+    dfa_cache_flush(p);
+  }
+  DfaState *d = &p->dfa_states[p->dfa_states_n];
+  d->nfa_states = malloc((n == 0 ? 1 : n) * sizeof(int));
+  if (d->nfa_states == NULL) {
+    fprintf(stderr, "Failed to allocate memory for DFA state!\n");
+    return -1;
+  }
+  memcpy(d->nfa_states, p->closure_set, n * sizeof(int));
+  d->nfa_states_n = n;
+  d->is_match = false;
+  for (size_t i = 0; i < n; i++) {
+    if (p->states[p->closure_set[i]].type == NFA_STATE_MATCH) {
+      d->is_match = true;
+    }
+  }
+  for (int c = 0; c < 256; c++) {
+    d->next[c] = -1;
+  }
+  return p->dfa_states_n++;
+}
+
+int dfa_start_state(Pattern *p) {
+  if (p->dfa_start < 0) {
+    size_t stack_n = 0;
+    memset(p->closure_marks, 0, p->states_n * sizeof(bool));
+    nfa_closure_add(p, p->start, &stack_n);
+    p->dfa_start = dfa_find_or_add(p, nfa_closure_collect(p));
+  }
+  return p->dfa_start;
+}
+
+int dfa_compute_next(Pattern *p, int from, unsigned char c) {
+  size_t stack_n = 0;
+  memset(p->closure_marks, 0, p->states_n * sizeof(bool));
+  DfaState *d = &p->dfa_states[from];
+  for (size_t i = 0; i < d->nfa_states_n; i++) {
+    NfaState *s = &p->states[d->nfa_states[i]];
+    if (s->type == NFA_STATE_CHARS && charset_has(s->chars, c)) {
+      nfa_closure_add(p, s->out, &stack_n);
+    }
+  }
+  if (!p->anchored_start) {
+    // a match may begin at any position
+    nfa_closure_add(p, p->start, &stack_n);
+  }
+  size_t states_before = p->dfa_states_n;
+  int next = dfa_find_or_add(p, nfa_closure_collect(p));
+  if (next >= 0 && p->dfa_states_n >= states_before) {
+    // the cache was not flushed, so `from` is still valid
+    p->dfa_states[from].next[c] = next;
+  }
+  return next;
+}
+
+bool pattern_matches(Pattern *p, const char *str) {
+  if (p->required != NULL && strcasestr(str, p->required) == NULL) {
+    return false;
+  }
+  int current = dfa_start_state(p);
+  const unsigned char *c = (const unsigned char *)str;
+  while (current >= 0) {
+    DfaState *d = &p->dfa_states[current];
+    if (d->is_match && (!p->anchored_end || *c == '\0')) {
+      return true;
+    }
+    if (*c == '\0' || d->nfa_states_n == 0) {
+      return false;
+    }
+    unsigned char folded = tolower(*c++);
+    int next = d->next[folded];
+    current = next >= 0 ? next : dfa_compute_next(p, current, folded);
+  }
+  return false;
+}
+
+/*
+ * Documents.
+ *
+ * An entry starting with '{' is a document: {name: Alice, address: {city:
+ * Berlin}}. Keys and values may be bare text or "quoted strings", and a
+ * value may be a nested document. Besides its text, every document entry
+ * keeps a binary encoding where any field is reachable without parsing the
+ * rest of the document:
+ *
+ *   document := u32 size, u32 fields_n, fields_n x (u32 key, u32 value),
+ *               then the keys and values the slots point at
+ *   key      := u32 length, bytes, '\0'
+ *   value    := u8 DOCUMENT_VALUE_STRING, u32 length, bytes, '\0'
+ *             | u8 DOCUMENT_VALUE_DOCUMENT, document
+ *
+ * Slot offsets are relative to the start of their document and slots are
+ * sorted by key, so a field is found by a binary search over the slots.
+ */
+
+#define DOCUMENT_HEADER_SIZE 8
+#define DOCUMENT_SLOT_SIZE 8
+#define DOCUMENT_MAX_DEPTH 100 // nested documents are parsed recursively
+
+typedef enum {
+  DOCUMENT_VALUE_STRING = 1,
+  DOCUMENT_VALUE_DOCUMENT = 2,
+} DocumentValueType;
+
+typedef struct DocumentField {
+  char *key;
+  char *string; // NULL for nested documents
+  struct DocumentField *fields;
+  size_t fields_n;
+} DocumentField;
+
+uint32_t read_u32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+void write_u32(unsigned char *p, uint32_t value) {
+  memcpy(p, &value, sizeof(value));
+}
+
+void document_fields_destroy(DocumentField *fields, size_t fields_n) {
+  for (size_t i = 0; i < fields_n; i++) {
+    free(fields[i].key);
+    free(fields[i].string);
+    document_fields_destroy(fields[i].fields, fields[i].fields_n);
+  }
+  free(fields);
+}
+
+typedef struct {
+  const char *s;
+  int depth;
+  const char *error;
+} DocumentParser;
+
+void document_parser_skip_spaces(DocumentParser *parser) {
+  while (*parser->s == ' ') {
+    parser->s++;
+  }
+}
+
+// Parses a quoted or a bare string ending at one of the stop characters
+char *document_parse_string(DocumentParser *parser, const char *stop) {
+  document_parser_skip_spaces(parser);
+  if (*parser->s != '"') {
+    size_t len = strcspn(parser->s, stop);
+    const char *start = parser->s;
+    parser->s += len;
+    while (len > 0 && start[len - 1] == ' ') {
+      len--;
+    }
+    if (len == 0) {
+      parser->error = "Empty key or value in document";
+      return NULL;
+    }
+    char *result = strndup(start, len);
+    if (result == NULL) {
+      parser->error = "Failed to allocate memory for document";
+    }
+    return result;
+  }
+
+  parser->s++;
+  char *result = malloc(strlen(parser->s) + 1);
+  if (result == NULL) {
+    parser->error = "Failed to allocate memory for document";
+    return NULL;
+  }
+  size_t len = 0;
+  while (*parser->s != '"') {
+    if (*parser->s == '\\' && parser->s[1] != '\0') {
+      parser->s++;
+    }
+    if (*parser->s == '\0') {
+      parser->error = "Unterminated string in document";
+      free(result);
+      return NULL;
+    }
+    result[len++] = *parser->s++;
+  }
+  parser->s++;
+  result[len] = '\0';
+  return result;
+}
+
+int document_field_compare(const void *a, const void *b) {
+  return strcmp(((const DocumentField *)a)->key,
+                ((const DocumentField *)b)->key);
+}
+
+// parser->s points at '{'
+bool document_parse_fields(DocumentParser *parser, DocumentField **fields,
+                           size_t *fields_n) {
+  *fields = NULL;
+  *fields_n = 0;
+  parser->s++;
+  document_parser_skip_spaces(parser);
+  if (*parser->s == '}') {
+    parser->s++;
+    return true;
+  }
+  size_t fields_cap = 0;
+  while (1) {
+    if (*fields_n == fields_cap) {
+      fields_cap = fields_cap == 0 ? 4 : fields_cap * 2;
+      DocumentField *new_fields =
+          realloc(*fields, fields_cap * sizeof(DocumentField));
+      if (new_fields == NULL) {
+        parser->error = "Failed to allocate memory for document";
+        return false;
+      }
+      *fields = new_fields;
+    }
+    DocumentField *field = &(*fields)[(*fields_n)++];
+    memset(field, 0, sizeof(DocumentField));
+
+    field->key = document_parse_string(parser, ":{},\"");
+    if (field->key == NULL) {
+      return false;
+    }
+    if (strchr(field->key, '.') != NULL) {
+      parser->error = "Keys of a document cannot contain '.'";
+      return false;
+    }
+    document_parser_skip_spaces(parser);
+    if (*parser->s != ':') {
+      parser->error = "Expected ':' after a key in document";
+      return false;
+    }
+    parser->s++;
+    document_parser_skip_spaces(parser);
+    if (*parser->s == '{') {
+      if (parser->depth == DOCUMENT_MAX_DEPTH) {
+        parser->error = "Document nested too deeply";
+        return false;
+      }
+      parser->depth++;
+      if (!document_parse_fields(parser, &field->fields, &field->fields_n)) {
+        return false;
+      }
+      parser->depth--;
+    } else {
+      field->string = document_parse_string(parser, ",}");
+      if (field->string == NULL) {
+        return false;
+      }
+    }
+
+    document_parser_skip_spaces(parser);
+    if (*parser->s == '}') {
+      parser->s++;
+      break;
+    }
+    if (*parser->s != ',') {
+      parser->error = "Expected ',' or '}' in document";
+      return false;
+    }
+    parser->s++;
+  }
+
+  qsort(*fields, *fields_n, sizeof(DocumentField), document_field_compare);
+  for (size_t i = 1; i < *fields_n; i++) {
+    if (str_eq((*fields)[i - 1].key, (*fields)[i].key)) {
+      parser->error = "Duplicate key in document";
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t document_encoded_size(const DocumentField *fields, size_t fields_n) {
+  size_t size = DOCUMENT_HEADER_SIZE + fields_n * DOCUMENT_SLOT_SIZE;
+  for (size_t i = 0; i < fields_n; i++) {
+    size += 4 + strlen(fields[i].key) + 1;
+    size += 1;
+    if (fields[i].string != NULL) {
+      size += 4 + strlen(fields[i].string) + 1;
+    } else {
+      size += document_encoded_size(fields[i].fields, fields[i].fields_n);
+    }
+  }
+  return size;
+}
+
+size_t document_encode_string(unsigned char *out, const char *s) {
+  size_t len = strlen(s);
+  write_u32(out, len);
+  memcpy(out + 4, s, len + 1);
+  return 4 + len + 1;
+}
+
+// Returns the number of bytes written
+size_t document_encode(unsigned char *out, const DocumentField *fields,
+                       size_t fields_n) {
+  size_t offset = DOCUMENT_HEADER_SIZE + fields_n * DOCUMENT_SLOT_SIZE;
+  for (size_t i = 0; i < fields_n; i++) {
+    unsigned char *slot = out + DOCUMENT_HEADER_SIZE + i * DOCUMENT_SLOT_SIZE;
+    write_u32(slot, offset);
+    offset += document_encode_string(out + offset, fields[i].key);
+    write_u32(slot + 4, offset);
+    if (fields[i].string != NULL) {
+      out[offset++] = DOCUMENT_VALUE_STRING;
+      offset += document_encode_string(out + offset, fields[i].string);
+    } else {
+      out[offset++] = DOCUMENT_VALUE_DOCUMENT;
+      offset +=
+          document_encode(out + offset, fields[i].fields, fields[i].fields_n);
+    }
+  }
+  write_u32(out, offset);
+  write_u32(out + 4, fields_n);
+  return offset;
+}
+
+bool is_document_text(const char *text) {
+  while (*text == ' ') {
+    text++;
+  }
+  return *text == '{';
+}
+
+/*
+ * Parses a document text into its binary encoding. On failure returns NULL
+ * and points *error to the reason.
+ */
+unsigned char *document_from_text(const char *text, const char **error) {
+  DocumentParser parser = {.s = text, .error = NULL};
+  document_parser_skip_spaces(&parser);
+  DocumentField *fields = NULL;
+  size_t fields_n = 0;
+  unsigned char *document = NULL;
+  if (!document_parse_fields(&parser, &fields, &fields_n)) {
+    goto cleanup;
+  }
+  document_parser_skip_spaces(&parser);
+  if (*parser.s != '\0') {
+    parser.error = "Unexpected text after document";
+    goto cleanup;
+  }
+  document = malloc(document_encoded_size(fields, fields_n));
+  if (document == NULL) {
+    parser.error = "Failed to allocate memory for document";
     goto cleanup;
   }
+  document_encode(document, fields, fields_n);
+
+cleanup:
+  document_fields_destroy(fields, fields_n);
+  *error = parser.error;
+  return document;
+}
+
+uint32_t document_fields_n(const unsigned char *document) {
+  return read_u32(document + 4);
+}
+
+const char *document_key(const unsigned char *document, uint32_t i) {
+  uint32_t offset = read_u32(document + DOCUMENT_HEADER_SIZE +
+                             i * DOCUMENT_SLOT_SIZE);
+  return (const char *)document + offset + 4;
+}
+
+// Points at the type byte of the value
+const unsigned char *document_value(const unsigned char *document,
+                                    uint32_t i) {
+  uint32_t offset = read_u32(document + DOCUMENT_HEADER_SIZE +
+                             i * DOCUMENT_SLOT_SIZE + 4);
+  return document + offset;
+}
+
+// Returns the value of a field (see document_value) or NULL
+const unsigned char *document_get(const unsigned char *document,
+                                  const char *key, size_t key_len) {
+  uint32_t lo = 0;
+  uint32_t hi = document_fields_n(document);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const char *mid_key = document_key(document, mid);
+    size_t mid_key_len = read_u32((const unsigned char *)mid_key - 4);
+    int cmp = memcmp(mid_key, key,
+                     mid_key_len < key_len ? mid_key_len : key_len);
+    if (cmp == 0) {
+      cmp = mid_key_len < key_len ? -1 : mid_key_len > key_len;
+    }
+    if (cmp == 0) {
+      return document_value(document, mid);
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+// Follows a dotted path like "address.city", returns the value or NULL
+const unsigned char *document_get_path(const unsigned char *document,
+                                       const char *path) {
+  while (1) {
+    size_t key_len = strcspn(path, ".");
+    const unsigned char *value = document_get(document, path, key_len);
+    if (value == NULL || path[key_len] == '\0') {
+      return value;
+    }
+    if (*value != DOCUMENT_VALUE_DOCUMENT) {
+      return NULL;
+    }
+    document = value + 1;
+    path += key_len + 1;
+  }
+}
+
+// For a DOCUMENT_VALUE_STRING value
+const char *document_value_string(const unsigned char *value) {
+  return (const char *)value + 1 + 4;
+}
+
+/*
+ * Calls fn for the dotted path of every value of the document, nested
+ * documents included.
+ * path is a scratch buffer holding path_len bytes of the parent path; as
+ * every key is encoded with its length and terminator, read_u32(document)
+ * bytes fit any path in it.
+ */
+bool document_for_each_path(const unsigned char *document, char *path,
+                            size_t path_len,
+                            bool (*fn)(const char *path, void *ctx),
+                            void *ctx) {
+  for (uint32_t i = 0; i < document_fields_n(document); i++) {
+    const char *key = document_key(document, i);
+    size_t key_len = read_u32((const unsigned char *)key - 4);
+    size_t len = path_len + (path_len != 0) + key_len;
+    if (path_len != 0) {
+      path[path_len] = '.';
+    }
+    memcpy(path + len - key_len, key, key_len + 1);
+
+    const unsigned char *value = document_value(document, i);
+    bool ok = fn(path, ctx) && (*value == DOCUMENT_VALUE_STRING ||
+                                document_for_each_path(value + 1, path, len,
+                                                       fn, ctx));
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef enum {
+  TOKEN_TYPE_STR,
+  TOKEN_TYPE_OP_OR,
+  TOKEN_TYPE_OP_AND,
+  TOKEN_TYPE_OP_NOT,
+  TOKEN_TYPE_PAR_OPEN,
+  TOKEN_TYPE_PAR_CLOSE,
+  TOKEN_TYPE_TRUE,
+  TOKEN_TYPE_FALSE,
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  char *str;
+  Pattern *pattern; // compiled pattern literal, NULL for plain substrings
+  char *path;       // dotted path of a field predicate, NULL for entries
+  bool exists;      // the field predicate matches any value at path
+} Token;
+
+typedef struct {
+  size_t tokens_n;
+  Token *tokens;
+} TokenList;
+
+TokenList *token_list_init(void) {
+  TokenList *token_list = malloc(sizeof(TokenList));
+  if (token_list == NULL) {
+    return NULL;
+  }
+  token_list->tokens_n = 0;
+  token_list->tokens = NULL;
+  return token_list;
+}
+
+void token_list_destroy_shallow(TokenList *token_list) {
+  if (token_list == NULL) {
+    return;
+  }
+  free(token_list->tokens);
+  token_list->tokens = NULL;
+  free(token_list);
+}
+
+void token_list_destroy_deep(TokenList *token_list) {
+  if (token_list == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < token_list->tokens_n; i++) {
+    if (token_list->tokens[i].type == TOKEN_TYPE_STR) {
+      free(token_list->tokens[i].str);
+      token_list->tokens[i].str = NULL;
+      pattern_destroy(token_list->tokens[i].pattern);
+      token_list->tokens[i].pattern = NULL;
+      free(token_list->tokens[i].path);
+      token_list->tokens[i].path = NULL;
+    }
+  }
+  token_list_destroy_shallow(token_list);
+}
+
+Token token_list_peek(TokenList *token_list) {
+  assert(token_list->tokens_n != 0);
+  return token_list->tokens[token_list->tokens_n - 1];
+}
+
+void token_list_drop_last_element(TokenList *token_list) {
+  assert(token_list->tokens_n != 0);
+  memset(&token_list->tokens[--token_list->tokens_n], 0, sizeof(Token));
+}
+
+Token token_list_pop(TokenList *token_list) {
+  Token result = token_list_peek(token_list);
+  token_list_drop_last_element(token_list);
+  return result;
+}
+
+void token_list_push(TokenList *token_list, Token new_token) {
+  token_list->tokens[token_list->tokens_n++] = new_token;
+}
+
+/*
+ * Makes a TOKEN_TYPE_STR token of a literal, compiling it if it is a
+ * pattern. Takes ownership of str and path (NULL unless it is a field
+ * predicate), which are freed on failure.
+ */
+bool str_token_init(Token *token, char *str, char *path) {
+  Pattern *pattern = NULL;
+  if (is_pattern_literal(str)) {
+    const char *error;
+    pattern = pattern_compile(str, &error);
+    if (pattern == NULL) {
+      if (error != NULL) {
+        fprintf(stderr, "%s: %s\n", error, str);
+      } else {
+        fprintf(stderr, "Failed to allocate memory for pattern! %s\n", str);
+      }
+      free(str);
+      free(path);
+      return false;
+    }
+  } else {
+    literal_unescape(str);
+  }
+  *token = (Token){
+      .type = TOKEN_TYPE_STR, .str = str, .pattern = pattern, .path = path};
+  return true;
+}
+
+// Length of the dotted path in a field prefix like "@address.city:" at
+// the start of s, or 0
+size_t field_path_length(const char *s) {
+  if (*s++ != '@') {
+    return 0;
+  }
+  size_t len = 0;
+  while (1) {
+    size_t segment_len = 0;
+    while (isalnum((unsigned char)s[len + segment_len]) ||
+           s[len + segment_len] == '_') {
+      segment_len++;
+    }
+    if (segment_len == 0) {
+      return 0;
+    }
+    len += segment_len;
+    if (s[len] == ':') {
+      return len;
+    }
+    if (s[len] != '.') {
+      return 0;
+    }
+    len++;
+  }
+}
+
+TokenList *tokenize(const char *s) {
+  // This treats whitespace after a word as a part of a token
+  TokenList *result = token_list_init();
+  if (result == NULL) {
+    fprintf(stderr, "Failed to allocate memory for token list!\n");
+    return NULL;
+  }
+  while (*s != '\0') {
+    if (*s == ' ') {
+      // dealing with the "leftmost" whitespaces, not belonging
+      // to any token
+      s++;
+      continue;
+    }
+
+    const size_t resize_block_size = 10;
+    if (result->tokens_n % resize_block_size == 0) {
+      result->tokens =
+          realloc(result->tokens,
+                  (result->tokens_n + resize_block_size) * sizeof(Token));
+    }
+
+    switch (*s) {
+    case '|':
+      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_OR, .str = NULL});
+      s++;
+      break;
+    case '&':
+      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_AND, .str = NULL});
+      s++;
+      break;
+    case '!':
+      token_list_push(result, (Token){.type = TOKEN_TYPE_OP_NOT, .str = NULL});
+      s++;
+      break;
+    case '(':
+      token_list_push(result,
+                      (Token){.type = TOKEN_TYPE_PAR_OPEN, .str = NULL});
+      s++;
+      break;
+    case ')':
+      token_list_push(result,
+                      (Token){.type = TOKEN_TYPE_PAR_CLOSE, .str = NULL});
+      s++;
+      break;
+    default: {
+      // a field predicate like "@address.city: Berlin" matches its value
+      // against the literal after ':', other text with ':' (e.g. "10:30")
+      // is a plain literal
+      size_t path_len = field_path_length(s);
+      const char *literal = s;
+      if (path_len != 0) {
+        literal = s + path_len + 2;
+        literal += strspn(literal, " ");
+      }
+
+      size_t token_str_len_with_right_spaces = 0;
+      int token_str_len_trimmed = 0;
+      if (*literal == '/') {
+        // a regex may contain operator characters, so it runs up to
+        // the closing unescaped '/' when that '/' ends the token;
+        // anything else (e.g. "/usr/bin") is searched as plain text
+        const char *close = literal + 1;
+        while (*close != '\0' &&
+               (*close != '/' || is_escaped(literal, close - literal))) {
+          close++;
+        }
+        if (*close != '\0') {
+          size_t len = close - s + 1 + strspn(close + 1, " ");
+          if (strchr("|&()!", s[len]) != NULL) {
+            token_str_len_trimmed = close - s + 1;
+            token_str_len_with_right_spaces = len;
+          }
+        }
+      }
+      if (token_str_len_trimmed == 0) {
+        token_str_len_with_right_spaces = strcspn(s, "|&()!");
+        assert(token_str_len_with_right_spaces != 0);
+
+        token_str_len_trimmed = token_str_len_with_right_spaces;
+        while (token_str_len_trimmed > 0 &&
+               s[token_str_len_trimmed - 1] == ' ') {
+          token_str_len_trimmed--;
+        }
+      }
+
+      char *path = NULL;
+      if (path_len != 0) {
+        if (s + token_str_len_trimmed <= literal) {
+          fprintf(stderr, "Missing value for field: %s\n", s);
+          token_list_destroy_deep(result);
+          return NULL;
+        }
+        path = strndup(s + 1, path_len);
+        if (path == NULL) {
+          fprintf(stderr, "Failed to allocate memory for token! %s\n", s);
+          token_list_destroy_deep(result);
+          return NULL;
+        }
+        token_str_len_trimmed -= literal - s;
+      }
+
+      char *token_str = strndup(literal, token_str_len_trimmed);
+      if (token_str == NULL) {
+        fprintf(stderr, "Failed to allocate memory for token! %s\n", s);
+        free(path);
+        token_list_destroy_deep(result);
+        return NULL;
+      }
+      Token token;
+      if (!str_token_init(&token, token_str, path)) {
+        token_list_destroy_deep(result);
+        return NULL;
+      }
+      token_list_push(result, token);
+      s += token_str_len_with_right_spaces;
+    }
+    }
+  }
+  return result;
+}
+
+int precedence(TokenType type) {
+  switch (type) {
+  case TOKEN_TYPE_OP_OR:
+    return 1;
+  case TOKEN_TYPE_OP_AND:
+    return 2;
+  case TOKEN_TYPE_OP_NOT:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+TokenList *to_postfix_notation(const TokenList *const token_list) {
+  TokenList *output_queue = token_list_init();
+  if (output_queue == NULL) {
+    fprintf(stderr, "Failed to allocate memory for output queue!\n");
+    return NULL;
+  }
+  TokenList *op_stack = token_list_init();
+  if (op_stack == NULL) {
+    fprintf(stderr, "Failed to allocate memory for op stack!\n");
+    goto clean_up_err;
+  }
+
+  // allocating maximum possible sizes
+  output_queue->tokens = calloc(token_list->tokens_n, sizeof(Token));
+  if (output_queue->tokens == NULL) {
+    fprintf(stderr, "Failed to allocate memory for output queue tokens!\n");
+    goto clean_up_err;
+  }
+  op_stack->tokens = calloc(token_list->tokens_n, sizeof(Token));
+  if (op_stack->tokens == NULL) {
+    fprintf(stderr, "Failed to allocate memory for op stack tokens!\n");
+    goto clean_up_err;
+  }
+
+  for (size_t i = 0; i < token_list->tokens_n; i++) {
+    Token current_tok = token_list->tokens[i];
+    switch (current_tok.type) {
+    case TOKEN_TYPE_STR:
+      token_list_push(output_queue, current_tok);
+      break;
+    case TOKEN_TYPE_OP_OR:
+    case TOKEN_TYPE_OP_NOT:
+    case TOKEN_TYPE_OP_AND: {
+      while (op_stack->tokens_n != 0) {
+        Token stack_op = token_list_peek(op_stack);
+        if (stack_op.type == TOKEN_TYPE_PAR_OPEN) {
+          break;
+        }
+
+        int current_tok_prec = precedence(current_tok.type);
+        int stack_op_prec = precedence(stack_op.type);
+
+        if (!(stack_op_prec > current_tok_prec ||
+              (stack_op_prec == current_tok_prec &&
+               current_tok.type != TOKEN_TYPE_OP_NOT))) {
+          break;
+        }
+        // add to queue
+        token_list_push(output_queue, stack_op);
+        token_list_drop_last_element(op_stack);
+      }
+      // o1 to stack
+      token_list_push(op_stack, current_tok);
+      break;
+    }
+    case TOKEN_TYPE_PAR_OPEN:
+      // push to stack
+      token_list_push(op_stack, current_tok);
+      break;
+    case TOKEN_TYPE_PAR_CLOSE: {
+      while (op_stack->tokens_n != 0) {
+        Token op_from_stack = token_list_peek(op_stack);
+        if (op_from_stack.type == TOKEN_TYPE_PAR_OPEN) {
+          break;
+        }
+        // from stack to queue
+        token_list_push(output_queue, op_from_stack);
+        token_list_drop_last_element(op_stack);
+      }
+      if (op_stack->tokens_n == 0 ||
+          token_list_peek(op_stack).type != TOKEN_TYPE_PAR_OPEN) {
+        fprintf(stderr, "Mismatched parentheses (while processing tokens)!\n");
+        goto clean_up_err;
+      }
+      token_list_drop_last_element(op_stack); // drop '('
+      /* we don't need function-before-( -- so just skipping it */
+      break;
+    }
+    case TOKEN_TYPE_TRUE:
+    case TOKEN_TYPE_FALSE:
+      break;
+    }
+  }
+
+  // going backwards, should know negative numbers :)
+  for (int i = op_stack->tokens_n - 1; i >= 0; --i) {
+    if (op_stack->tokens[i].type == TOKEN_TYPE_PAR_OPEN) {
+      fprintf(stderr, "Mismatched parentheses (while building output)!\n");
+      goto clean_up_err;
+    }
+    token_list_push(output_queue, op_stack->tokens[i]);
+  }
+
+  token_list_destroy_shallow(op_stack);
+  return output_queue;
+
+clean_up_err:
+  token_list_destroy_shallow(output_queue);
+  token_list_destroy_shallow(op_stack);
+  return NULL;
+}
+
+// document is the encoding of the entry str, NULL if it is not a document
+bool token_matches(Token token, const char *str,
+                   const unsigned char *document) {
+  if (token.path != NULL) {
+    const unsigned char *value =
+        document != NULL ? document_get_path(document, token.path) : NULL;
+    if (token.exists) {
+      return value != NULL;
+    }
+    if (value == NULL || *value != DOCUMENT_VALUE_STRING) {
+      return false;
+    }
+    str = document_value_string(value);
+  }
+  if (token.pattern != NULL) {
+    return pattern_matches(token.pattern, str);
+  }
+  return strcasestr(str, token.str) != NULL;
+}
+
+/*
+ * Results of the literals of a filter batch for the current entry, so that
+ * a literal used several times is matched only once per entry.
+ */
+typedef struct {
+  const Token *leaves; // tokens with distinct str pointers
+  size_t leaves_n;
+  signed char *results; // -1 while not evaluated yet
+} LeafCache;
+
+bool token_matches_cached(Token token, const char *str,
+                          const unsigned char *document, LeafCache *cache) {
+  if (cache == NULL) {
+    return token_matches(token, str, document);
+  }
+  for (size_t i = 0; i < cache->leaves_n; i++) {
+    if (cache->leaves[i].str == token.str) {
+      if (cache->results[i] < 0) {
+        cache->results[i] = token_matches(token, str, document);
+      }
+      return cache->results[i];
+    }
+  }
+  return token_matches(token, str, document);
+}
+
+// Whether every operator of the postfixed query has its operands
+bool is_valid_postfix(const TokenList *const pf_list) {
+  size_t stack_n = 0;
+  for (size_t i = 0; i < pf_list->tokens_n; i++) {
+    switch (pf_list->tokens[i].type) {
+    case TOKEN_TYPE_STR:
+    case TOKEN_TYPE_TRUE:
+    case TOKEN_TYPE_FALSE:
+      stack_n++;
+      break;
+    case TOKEN_TYPE_OP_NOT:
+      if (stack_n == 0) {
+        return false;
+      }
+      break;
+    case TOKEN_TYPE_OP_AND:
+    case TOKEN_TYPE_OP_OR:
+      if (stack_n < 2) {
+        return false;
+      }
+      stack_n--;
+      break;
+    default:
+      return false;
+    }
+  }
+  return stack_n == 1;
+}
+
+// cache may be NULL
+bool eval_postfixed_tokens_on_entry(const TokenList *const pf_list,
+                                    const char *str,
+                                    const unsigned char *document,
+                                    LeafCache *cache) {
+  if (pf_list == NULL) {
+    fprintf(stderr, "NULL postfix list!\n");
+    return false;
+  }
+  if (pf_list->tokens_n == 1) {
+    if (pf_list->tokens[0].type == TOKEN_TYPE_TRUE ||
+        pf_list->tokens[0].type == TOKEN_TYPE_FALSE) {
+      return pf_list->tokens[0].type == TOKEN_TYPE_TRUE;
+    }
+    if (pf_list->tokens[0].type != TOKEN_TYPE_STR) {
+      fprintf(stderr, "Not a valid search pattern\n");
+      return false;
+    }
+    return token_matches_cached(pf_list->tokens[0], str, document, cache);
+  }
+
+  TokenList *stack = token_list_init();
+  if (stack == NULL) {
+    fprintf(stderr, "Failed to allocate memory for stack!\n");
+    goto cleanup;
+  }
+
+  // allocating maximum possible size
+  stack->tokens = calloc(pf_list->tokens_n, sizeof(Token));
+  if (stack->tokens == NULL) {
+    fprintf(stderr, "Failed to allocate memory for stack tokens!\n");
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < pf_list->tokens_n; i++) {
+    Token current_tok = pf_list->tokens[i];
+    switch (current_tok.type) {
+    case TOKEN_TYPE_STR:
+    case TOKEN_TYPE_TRUE:
+    case TOKEN_TYPE_FALSE:
+      token_list_push(stack, current_tok);
+      break;
+    case TOKEN_TYPE_OP_NOT: {
+      Token stack_token = token_list_pop(stack);
+      if (stack_token.type == TOKEN_TYPE_STR) {
+        bool str_of_token_found =
+            token_matches_cached(stack_token, str, document, cache);
+        token_list_push(stack,
+                        (Token){.type = (str_of_token_found) ? TOKEN_TYPE_FALSE
+                                                             : TOKEN_TYPE_TRUE,
+                                .str = NULL});
+      } else if (stack_token.type == TOKEN_TYPE_TRUE) {
+        token_list_push(stack, (Token){.type = TOKEN_TYPE_FALSE, .str = NULL});
+      } else if (stack_token.type == TOKEN_TYPE_FALSE) {
+        token_list_push(stack, (Token){.type = TOKEN_TYPE_TRUE, .str = NULL});
+      } else {
+        fprintf(stderr, "Unexpected token type: %d\n", stack_token.type);
+        assert(false);
+      }
+      break;
+    }
+    case TOKEN_TYPE_OP_OR:
+    case TOKEN_TYPE_OP_AND: {
+      Token op2 = token_list_pop(stack);
+      Token op1 = token_list_pop(stack);
+
+      bool op1_result;
+      if (op1.type == TOKEN_TYPE_STR) {
+        op1_result = token_matches_cached(op1, str, document, cache);
+      } else {
+        assert(op1.type == TOKEN_TYPE_TRUE || op1.type == TOKEN_TYPE_FALSE);
+        op1_result = op1.type == TOKEN_TYPE_TRUE;
+      }
+
+      bool op2_result;
+      if (op2.type == TOKEN_TYPE_STR) {
+        op2_result = token_matches_cached(op2, str, document, cache);
+      } else {
+        assert(op2.type == TOKEN_TYPE_TRUE || op2.type == TOKEN_TYPE_FALSE);
+        op2_result = op2.type == TOKEN_TYPE_TRUE;
+      }
+
+      bool new_value;
+      if (current_tok.type == TOKEN_TYPE_OP_OR) {
+        new_value = op1_result || op2_result;
+      } else {
+        new_value = op1_result && op2_result;
+      }
+      token_list_push(stack, (Token){.type = (new_value) ? TOKEN_TYPE_TRUE
+                                                         : TOKEN_TYPE_FALSE,
+                                     .str = NULL});
+      break;
+    }
+    default:
+      printf("Unknown token type: %d\n", current_tok.type);
+      assert(false);
+    }
+  }
+
+  assert(stack->tokens_n == 1);
+  bool result = stack->tokens[0].type == TOKEN_TYPE_TRUE;
+  token_list_destroy_shallow(stack);
+  return result;
+
+cleanup:
+  token_list_destroy_shallow(stack);
+  return false;
+}
+
+bool eval_postfixed_tokens_as_predicate(const TokenList *const pf_list,
+                                        const char *str) {
+  return eval_postfixed_tokens_on_entry(pf_list, str, NULL, NULL);
+}
+
+/*
+ * Path index: a dictionary of the dotted paths of all values in documents,
+ * each with a posting list of the entries having such a value.
+ * Posting lists are exact: an entry whose postings cannot all be added is
+ * not stored, so a search may skip the entries missing from them.
+ */
+
+typedef struct {
+  char *path;
+  size_t *postings;
+  size_t postings_n;
+  size_t postings_cap;
+} PathPostings;
+
+PathPostings *paths = NULL;
+size_t paths_n = 0;
+size_t paths_cap = 0;
+
+// entry_documents[i] is the encoding of entries[i], NULL if it is not a
+// document. Compressed blocks keep the encodings next to the text.
+unsigned char *entry_documents[MAX_ENTRIES_N];
+
+PathPostings *path_index_find(const char *path) {
+  for (size_t i = 0; i < paths_n; i++) {
+    if (str_eq(paths[i].path, path)) {
+      return &paths[i];
+    }
+  }
+  return NULL;
+}
+
+bool path_index_add_posting(const char *path, void *ctx) {
+  size_t entry_number = *(const size_t *)ctx;
+  PathPostings *postings = path_index_find(path);
+  if (postings == NULL) {
+    if (paths_n == paths_cap) {
+      size_t new_cap = paths_cap == 0 ? 16 : paths_cap * 2;
+      PathPostings *new_paths = realloc(paths, new_cap * sizeof(PathPostings));
+      if (new_paths == NULL) {
+        fprintf(stderr, "Failed to allocate memory for path index!\n");
+        return false;
+      }
+      paths = new_paths;
+      paths_cap = new_cap;
+    }
+    char *path_copy = strdup(path);
+    if (path_copy == NULL) {
+      fprintf(stderr, "Failed to allocate memory for path index!\n");
+      return false;
+    }
+    postings = &paths[paths_n++];
+    *postings = (PathPostings){.path = path_copy,
+                               .postings = NULL,
+                               .postings_n = 0,
+                               .postings_cap = 0};
+  }
+  if (postings->postings_n == postings->postings_cap) {
+    size_t new_cap =
+        postings->postings_cap == 0 ? 8 : postings->postings_cap * 2;
+    size_t *new_postings =
+        realloc(postings->postings, new_cap * sizeof(size_t));
+    if (new_postings == NULL) {
+      fprintf(stderr, "Failed to allocate memory for path index!\n");
+      return false;
+    }
+    postings->postings = new_postings;
+    postings->postings_cap = new_cap;
+  }
+  postings->postings[postings->postings_n++] = entry_number;
+  return true;
+}
+
+bool path_index_remove_posting(const char *path, void *ctx) {
+  size_t entry_number = *(const size_t *)ctx;
+  PathPostings *postings = path_index_find(path);
+  if (postings == NULL) {
+    return true;
+  }
+  for (size_t i = 0; i < postings->postings_n; i++) {
+    if (postings->postings[i] == entry_number) {
+      postings->postings[i] = postings->postings[--postings->postings_n];
+      break;
+    }
+  }
+  return true;
+}
+
+bool path_index_renumber_posting(const char *path, void *ctx) {
+  const size_t *from_to = ctx;
+  PathPostings *postings = path_index_find(path);
+  if (postings == NULL) {
+    return true;
+  }
+  for (size_t i = 0; i < postings->postings_n; i++) {
+    if (postings->postings[i] == from_to[0]) {
+      postings->postings[i] = from_to[1];
+      break;
+    }
+  }
+  return true;
+}
+
+// path is a scratch buffer of at least read_u32(document) bytes, so that
+// removing and renumbering postings cannot fail
+bool path_index_update(const unsigned char *document, char *path,
+                       bool (*fn)(const char *path, void *ctx), void *ctx) {
+  return document_for_each_path(document, path, 0, fn, ctx);
+}
+
+void path_index_destroy(void) {
+  for (size_t i = 0; i < paths_n; i++) {
+    free(paths[i].path);
+    free(paths[i].postings);
+  }
+  free(paths);
+  paths = NULL;
+  paths_n = 0;
+  paths_cap = 0;
+}
+
+/*
+ * Evaluates the postfixed predicate over posting lists: a field predicate
+ * can only match entries having its path, anything else may match any
+ * entry. Returns the candidate entries out of entries_total, or NULL when
+ * every entry is a candidate.
+ */
+bool *path_index_candidates(const TokenList *const pf_list,
+                            size_t entries_total) {
+  bool **stack = calloc(pf_list->tokens_n, sizeof(bool *));
+  if (stack == NULL) {
+    return NULL;
+  }
+  size_t stack_n = 0;
+  bool ok = true;
+  for (size_t i = 0; i < pf_list->tokens_n && ok; i++) {
+    Token token = pf_list->tokens[i];
+    switch (token.type) {
+    case TOKEN_TYPE_STR: {
+      bool *set = NULL;
+      if (token.path != NULL) {
+        set = calloc(entries_total == 0 ? 1 : entries_total, sizeof(bool));
+        if (set == NULL) {
+          ok = false;
+          break;
+        }
+        PathPostings *postings = path_index_find(token.path);
+        for (size_t j = 0; postings != NULL && j < postings->postings_n; j++) {
+          if (postings->postings[j] < entries_total) {
+            set[postings->postings[j]] = true;
+          }
+        }
+      }
+      stack[stack_n++] = set;
+      break;
+    }
+    case TOKEN_TYPE_TRUE:
+    case TOKEN_TYPE_FALSE:
+      stack[stack_n++] = NULL;
+      break;
+    case TOKEN_TYPE_OP_NOT:
+      if (stack_n == 0) {
+        ok = false;
+        break;
+      }
+      free(stack[stack_n - 1]);
+      stack[stack_n - 1] = NULL;
+      break;
+    case TOKEN_TYPE_OP_AND:
+    case TOKEN_TYPE_OP_OR: {
+      if (stack_n < 2) {
+        ok = false;
+        break;
+      }
+      bool *op2 = stack[--stack_n];
+      bool *op1 = stack[stack_n - 1];
+      if (op1 == NULL || op2 == NULL) {
+        bool *known = op1 != NULL ? op1 : op2;
+        if (token.type == TOKEN_TYPE_OP_AND) {
+          stack[stack_n - 1] = known;
+        } else {
+          free(known);
+          stack[stack_n - 1] = NULL;
+        }
+        break;
+      }
+      for (size_t j = 0; j < entries_total; j++) {
+        op1[j] = token.type == TOKEN_TYPE_OP_AND ? op1[j] && op2[j]
+                                                 : op1[j] || op2[j];
+      }
+      free(op2);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  bool *result = ok && stack_n == 1 ? stack[0] : NULL;
+  for (size_t i = 0; i < stack_n; i++) {
+    if (stack[i] != result) {
+      free(stack[i]);
+    }
+  }
+  free(stack);
+  return result;
+}
+
+/*
+ * Filters searched for in one pass over the storage. A plain search is a
+ * batch of one filter, while `find` may compile several of them with their
+ * literals interned into `leaves`, so that each distinct literal is matched
+ * once per entry however many filters use it (see LeafCache).
+ */
+typedef struct {
+  TokenList **filters; // postfixed
+  size_t filters_n;
+  Token *leaves; // owned by the batch, may be NULL
+  size_t leaves_n;
+  size_t leaves_cap;
+
+  // set up by filter_batch_prepare
+  bool **candidates; // per filter, see path_index_candidates
+  size_t *matches_n; // per filter
+  bool *matched;     // per filter, for the last evaluated entry
+  signed char *leaf_results;
+  int *block_stack; // scratch for compressed_block_may_match
+} FilterBatch;
+
+void filter_batch_release(FilterBatch *batch) {
+  if (batch->candidates != NULL) {
+    for (size_t i = 0; i < batch->filters_n; i++) {
+      free(batch->candidates[i]);
+    }
+  }
+  free(batch->candidates);
+  batch->candidates = NULL;
+  free(batch->matches_n);
+  batch->matches_n = NULL;
+  free(batch->matched);
+  batch->matched = NULL;
+  free(batch->leaf_results);
+  batch->leaf_results = NULL;
+  free(batch->block_stack);
+  batch->block_stack = NULL;
+}
+
+bool filter_batch_prepare(FilterBatch *batch, size_t entries_total) {
+  assert(batch->filters_n != 0);
+  size_t longest_filter_n = 1;
+  for (size_t i = 0; i < batch->filters_n; i++) {
+    if (!is_valid_postfix(batch->filters[i])) {
+      fprintf(stderr, "Operator without operands in query!\n");
+      return false;
+    }
+    if (batch->filters[i]->tokens_n > longest_filter_n) {
+      longest_filter_n = batch->filters[i]->tokens_n;
+    }
+  }
+  batch->candidates = calloc(batch->filters_n, sizeof(bool *));
+  batch->matches_n = calloc(batch->filters_n, sizeof(size_t));
+  batch->matched = calloc(batch->filters_n, sizeof(bool));
+  batch->leaf_results = malloc(batch->leaves_n == 0 ? 1 : batch->leaves_n);
+  batch->block_stack = malloc(longest_filter_n * sizeof(int));
+  if (batch->candidates == NULL || batch->matches_n == NULL ||
+      batch->matched == NULL || batch->leaf_results == NULL ||
+      batch->block_stack == NULL) {
+    fprintf(stderr, "Failed to allocate memory for filters!\n");
+    filter_batch_release(batch);
+    return false;
+  }
+  for (size_t i = 0; i < batch->filters_n; i++) {
+    batch->candidates[i] =
+        path_index_candidates(batch->filters[i], entries_total);
+  }
+  return true;
+}
+
+void filter_batch_destroy(FilterBatch *batch) {
+  filter_batch_release(batch);
+  for (size_t i = 0; i < batch->filters_n; i++) {
+    token_list_destroy_shallow(batch->filters[i]);
+  }
+  free(batch->filters);
+  batch->filters = NULL;
+  batch->filters_n = 0;
+  for (size_t i = 0; i < batch->leaves_n; i++) {
+    free(batch->leaves[i].str);
+    pattern_destroy(batch->leaves[i].pattern);
+    free(batch->leaves[i].path);
+  }
+  free(batch->leaves);
+  batch->leaves = NULL;
+  batch->leaves_n = 0;
+  batch->leaves_cap = 0;
+}
+
+// Returns whether any of the filters matches the entry
+bool filter_batch_eval_entry(FilterBatch *batch, size_t entry_number,
+                             const char *entry,
+                             const unsigned char *document) {
+  memset(batch->leaf_results, -1, batch->leaves_n);
+  LeafCache cache = {.leaves = batch->leaves,
+                     .leaves_n = batch->leaves_n,
+                     .results = batch->leaf_results};
+  bool any_matched = false;
+  for (size_t i = 0; i < batch->filters_n; i++) {
+    batch->matched[i] =
+        (batch->candidates[i] == NULL || batch->candidates[i][entry_number]) &&
+        eval_postfixed_tokens_on_entry(batch->filters[i], entry, document,
+                                       &cache);
+    if (batch->matched[i]) {
+      batch->matches_n[i]++;
+      any_matched = true;
+    }
+  }
+  return any_matched;
+}
+
+void filter_batch_print_entry(const FilterBatch *batch, size_t entry_number,
+                              const char *entry) {
+  printf("%zu) %s", entry_number, entry);
+  if (batch->filters_n > 1) {
+    const char *separator = " [filters: ";
+    for (size_t i = 0; i < batch->filters_n; i++) {
+      if (batch->matched[i]) {
+        printf("%s%zu", separator, i);
+        separator = ", ";
+      }
+    }
+    printf("]");
+  }
+  printf("\n");
+}
+
+/*
+ * JSON filters.
+ *
+ * `find` takes a MongoDB-like filter, e.g.
+ *   {"address.city": "Berlin", "$or": [{"name": {"$regex": "^a"}},
+ *                                      {"tags": {"$exists": true}}]}
+ * or an array of such filters to run as a batch. A value matches exactly
+ * (substrings and patterns are left to $regex and $text), and a nested
+ * object without operators descends into a nested document. The filter is
+ * read by a pull lexer with one reusable string buffer and compiled
+ * straight into postfixed tokens, without building a tree or an infix
+ * string first.
+ */
+
+#define FILTER_MAX_DEPTH 100 // filter objects are compiled recursively
+
+typedef enum {
+  JSON_TOKEN_BEGIN_OBJECT,
+  JSON_TOKEN_END_OBJECT,
+  JSON_TOKEN_BEGIN_ARRAY,
+  JSON_TOKEN_END_ARRAY,
+  JSON_TOKEN_COLON,
+  JSON_TOKEN_COMMA,
+  JSON_TOKEN_STRING,
+  JSON_TOKEN_NUMBER,
+  JSON_TOKEN_TRUE,
+  JSON_TOKEN_FALSE,
+  JSON_TOKEN_NULL,
+  JSON_TOKEN_END,
+} JsonTokenType;
+
+typedef struct {
+  const char *s;
+  JsonTokenType type;
+  char *text; // decoded JSON_TOKEN_STRING or JSON_TOKEN_NUMBER, reused
+  size_t text_n;
+  size_t text_cap;
+  const char *error;
+} JsonLexer;
+
+bool json_text_reserve(JsonLexer *lexer, size_t size) {
+  if (size <= lexer->text_cap) {
+    return true;
+  }
+  size_t new_cap = lexer->text_cap == 0 ? 64 : lexer->text_cap * 2;
+  if (new_cap < size) {
+    new_cap = size;
+  }
+  char *new_text = realloc(lexer->text, new_cap);
+  if (new_text == NULL) {
+    lexer->error = "Failed to allocate memory for JSON string";
+    return false;
+  }
+  lexer->text = new_text;
+  lexer->text_cap = new_cap;
+  return true;
+}
+
+bool json_text_push(JsonLexer *lexer, char c) {
+  if (!json_text_reserve(lexer, lexer->text_n + 2)) {
+    return false;
+  }
+  lexer->text[lexer->text_n++] = c;
+  lexer->text[lexer->text_n] = '\0';
+  return true;
+}
+
+// Reads the 4 hex digits of a \u escape, returns -1 if they are malformed
+long json_read_hex4(const char *s) {
+  long value = 0;
+  for (int i = 0; i < 4; i++) {
+    if (!isxdigit((unsigned char)s[i])) {
+      return -1;
+    }
+    value = value * 16 + (isdigit((unsigned char)s[i])
+                              ? s[i] - '0'
+                              : tolower((unsigned char)s[i]) - 'a' + 10);
+  }
+  return value;
+}
+
+bool json_text_push_utf8(JsonLexer *lexer, long code_point) {
+  if (code_point < 0x80) {
+    return json_text_push(lexer, code_point);
+  }
+  if (code_point < 0x800) {
+    return json_text_push(lexer, 0xc0 | code_point >> 6) &&
+           json_text_push(lexer, 0x80 | (code_point & 0x3f));
+  }
+  if (code_point < 0x10000) {
+    return json_text_push(lexer, 0xe0 | code_point >> 12) &&
+           json_text_push(lexer, 0x80 | (code_point >> 6 & 0x3f)) &&
+           json_text_push(lexer, 0x80 | (code_point & 0x3f));
+  }
+  return json_text_push(lexer, 0xf0 | code_point >> 18) &&
+         json_text_push(lexer, 0x80 | (code_point >> 12 & 0x3f)) &&
+         json_text_push(lexer, 0x80 | (code_point >> 6 & 0x3f)) &&
+         json_text_push(lexer, 0x80 | (code_point & 0x3f));
+}
+
+// lexer->s points right after the opening quote
+bool json_lex_string(JsonLexer *lexer) {
+  while (*lexer->s != '"') {
+    unsigned char c = *lexer->s++;
+    if (c == '\0' || c < 0x20) {
+      lexer->error = c == '\0' ? "Unterminated JSON string"
+                               : "Control character in JSON string";
+      return false;
+    }
+    if (c != '\\') {
+      if (!json_text_push(lexer, c)) {
+        return false;
+      }
+      continue;
+    }
+    c = *lexer->s++;
+    char unescaped;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      unescaped = c;
+      break;
+    case 'b':
+      unescaped = '\b';
+      break;
+    case 'f':
+      unescaped = '\f';
+      break;
+    case 'n':
+      unescaped = '\n';
+      break;
+    case 'r':
+      unescaped = '\r';
+      break;
+    case 't':
+      unescaped = '\t';
+      break;
+    case 'u':
+      unescaped = '\0';
+      break;
+    default:
+      lexer->error = "Invalid escape in JSON string";
+      return false;
+    }
+    if (unescaped != '\0') {
+      if (!json_text_push(lexer, unescaped)) {
+        return false;
+      }
+      continue;
+    }
+    long code_point = json_read_hex4(lexer->s);
+    if (code_point <= 0) {
+      lexer->error = "Invalid \\u escape in JSON string";
+      return false;
+    }
+    lexer->s += 4;
+    if (code_point >= 0xd800 && code_point <= 0xdbff) {
+      long low = lexer->s[0] == '\\' && lexer->s[1] == 'u'
+                     ? json_read_hex4(lexer->s + 2)
+                     : -1;
+      if (low < 0xdc00 || low > 0xdfff) {
+        lexer->error = "Unpaired surrogate in JSON string";
+        return false;
+      }
+      lexer->s += 6;
+      code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+    } else if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+      lexer->error = "Unpaired surrogate in JSON string";
+      return false;
+    }
+    if (!json_text_push_utf8(lexer, code_point)) {
+      return false;
+    }
+  }
+  lexer->s++;
+  return true;
+}
+
+bool json_lex_number(JsonLexer *lexer) {
+  const char *start = lexer->s;
+  const char *s = start;
+  if (*s == '-') {
+    s++;
+  }
+  if (!isdigit((unsigned char)*s) ||
+      (*s == '0' && isdigit((unsigned char)s[1]))) {
+    lexer->error = "Invalid JSON number";
+    return false;
+  }
+  while (isdigit((unsigned char)*s)) {
+    s++;
+  }
+  if (*s == '.') {
+    if (!isdigit((unsigned char)*++s)) {
+      lexer->error = "Invalid JSON number";
+      return false;
+    }
+    while (isdigit((unsigned char)*s)) {
+      s++;
+    }
+  }
+  if (*s == 'e' || *s == 'E') {
+    s++;
+    if (*s == '+' || *s == '-') {
+      s++;
+    }
+    if (!isdigit((unsigned char)*s)) {
+      lexer->error = "Invalid JSON number";
+      return false;
+    }
+    while (isdigit((unsigned char)*s)) {
+      s++;
+    }
+  }
+  for (; start < s; start++) {
+    if (!json_text_push(lexer, *start)) {
+      return false;
+    }
+  }
+  lexer->s = s;
+  return true;
+}
+
+// Moves on to the next token, returns false on malformed input
+bool json_lexer_next(JsonLexer *lexer) {
+  while (isspace((unsigned char)*lexer->s)) {
+    lexer->s++;
+  }
+  lexer->text_n = 0;
+  const char *keywords[] = {"true", "false", "null"};
+  const JsonTokenType keyword_types[] = {JSON_TOKEN_TRUE, JSON_TOKEN_FALSE,
+                                         JSON_TOKEN_NULL};
+  switch (*lexer->s) {
+  case '\0':
+    lexer->type = JSON_TOKEN_END;
+    return true;
+  case '{':
+    lexer->type = JSON_TOKEN_BEGIN_OBJECT;
+    break;
+  case '}':
+    lexer->type = JSON_TOKEN_END_OBJECT;
+    break;
+  case '[':
+    lexer->type = JSON_TOKEN_BEGIN_ARRAY;
+    break;
+  case ']':
+    lexer->type = JSON_TOKEN_END_ARRAY;
+    break;
+  case ':':
+    lexer->type = JSON_TOKEN_COLON;
+    break;
+  case ',':
+    lexer->type = JSON_TOKEN_COMMA;
+    break;
+  case '"':
+    lexer->type = JSON_TOKEN_STRING;
+    lexer->s++;
+    if (!json_text_reserve(lexer, 1)) {
+      return false;
+    }
+    lexer->text[0] = '\0';
+    return json_lex_string(lexer);
+  default:
+    if (*lexer->s == '-' || isdigit((unsigned char)*lexer->s)) {
+      lexer->type = JSON_TOKEN_NUMBER;
+      return json_lex_number(lexer);
+    }
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+      size_t len = strlen(keywords[i]);
+      if (strncmp(lexer->s, keywords[i], len) == 0 &&
+          !isalnum((unsigned char)lexer->s[len])) {
+        lexer->type = keyword_types[i];
+        lexer->s += len;
+        return true;
+      }
+    }
+    lexer->error = "Unexpected character in JSON";
+    return false;
+  }
+  lexer->s++;
+  return true;
+}
+
+typedef struct {
+  JsonLexer lexer;
+  FilterBatch *batch;
+  TokenList *output; // the postfixed filter being compiled
+  int depth;         // of filter objects
+} FilterCompiler;
+
+bool filter_compiler_emit(FilterCompiler *c, Token token) {
+  const size_t resize_block_size = 16;
+  TokenList *output = c->output;
+  if (output->tokens_n % resize_block_size == 0) {
+    Token *new_tokens =
+        realloc(output->tokens,
+                (output->tokens_n + resize_block_size) * sizeof(Token));
+    if (new_tokens == NULL) {
+      c->lexer.error = "Failed to allocate memory for filter";
+      return false;
+    }
+    output->tokens = new_tokens;
+  }
+  token_list_push(output, token);
+  return true;
+}
+
+bool filter_compiler_emit_op(FilterCompiler *c, TokenType type) {
+  return filter_compiler_emit(c, (Token){.type = type, .str = NULL});
+}
+
+/*
+ * Emits a literal for a path (NULL for the whole entry), or with exists a
+ * leaf matching any value at the path. Equal leaves of the batch share one
+ * token. Takes ownership of literal.
+ */
+bool filter_compiler_emit_leaf(FilterCompiler *c, const char *path,
+                               char *literal, bool exists) {
+  if (literal == NULL) {
+    c->lexer.error = "Failed to allocate memory for filter";
+    return false;
+  }
+  FilterBatch *batch = c->batch;
+  for (size_t i = 0; i < batch->leaves_n; i++) {
+    Token leaf = batch->leaves[i];
+    bool same_path = path == NULL
+                         ? leaf.path == NULL
+                         : leaf.path != NULL && str_eq(leaf.path, path);
+    if (same_path && leaf.exists == exists && str_eq(leaf.str, literal)) {
+      free(literal);
+      return filter_compiler_emit(c, leaf);
+    }
+  }
+
+  if (batch->leaves_n == batch->leaves_cap) {
+    size_t new_cap = batch->leaves_cap == 0 ? 8 : batch->leaves_cap * 2;
+    Token *new_leaves = realloc(batch->leaves, new_cap * sizeof(Token));
+    if (new_leaves == NULL) {
+      free(literal);
+      c->lexer.error = "Failed to allocate memory for filter";
+      return false;
+    }
+    batch->leaves = new_leaves;
+    batch->leaves_cap = new_cap;
+  }
+  char *path_copy = NULL;
+  if (path != NULL && (path_copy = strdup(path)) == NULL) {
+    free(literal);
+    c->lexer.error = "Failed to allocate memory for filter";
+    return false;
+  }
+  Token leaf;
+  if (!str_token_init(&leaf, literal, path_copy)) {
+    c->lexer.error = "Invalid literal in filter";
+    return false;
+  }
+  leaf.exists = exists;
+  batch->leaves[batch->leaves_n++] = leaf;
+  return filter_compiler_emit(c, leaf);
+}
+
+// A literal matching exactly the value (case-insensitively, like search)
+char *exact_literal(const char *value) {
+  char *literal = malloc(2 * strlen(value) + 3);
+  if (literal == NULL) {
+    return NULL;
+  }
+  size_t len = 0;
+  literal[len++] = '^';
+  for (; *value != '\0'; value++) {
+    if (*value == '*' || *value == '?' || *value == '\\') {
+      literal[len++] = '\\';
+    }
+    literal[len++] = *value;
+  }
+  literal[len++] = '$';
+  literal[len] = '\0';
+  return literal;
+}
+
+char *regex_literal(const char *regex) {
+  size_t len = strlen(regex);
+  char *literal = malloc(len + 3);
+  if (literal == NULL) {
+    return NULL;
+  }
+  literal[0] = '/';
+  memcpy(literal + 1, regex, len);
+  literal[len + 1] = '/';
+  literal[len + 2] = '\0';
+  return literal;
+}
+
+bool filter_compiler_expect(FilterCompiler *c, JsonTokenType type,
+                            const char *error) {
+  if (c->lexer.type != type) {
+    c->lexer.error = error;
+    return false;
+  }
+  return json_lexer_next(&c->lexer);
+}
+
+bool filter_compile_object(FilterCompiler *c, const char *path);
+
+// An array of filters joined by `op`, each applied under path
+bool filter_compile_array(FilterCompiler *c, const char *path, TokenType op) {
+  if (!filter_compiler_expect(c, JSON_TOKEN_BEGIN_ARRAY,
+                              "Expected an array of filters")) {
+    return false;
+  }
+  if (c->lexer.type == JSON_TOKEN_END_ARRAY) {
+    return filter_compiler_emit_op(c, op == TOKEN_TYPE_OP_AND
+                                          ? TOKEN_TYPE_TRUE
+                                          : TOKEN_TYPE_FALSE) &&
+           json_lexer_next(&c->lexer);
+  }
+  for (size_t i = 0;; i++) {
+    if (!filter_compile_object(c, path) ||
+        (i != 0 && !filter_compiler_emit_op(c, op))) {
+      return false;
+    }
+    if (c->lexer.type != JSON_TOKEN_COMMA) {
+      return filter_compiler_expect(c, JSON_TOKEN_END_ARRAY,
+                                    "Expected ',' or ']' in filter");
+    }
+    if (!json_lexer_next(&c->lexer)) {
+      return false;
+    }
+  }
+}
+
+bool filter_compile_in(FilterCompiler *c, const char *path) {
+  if (!filter_compiler_expect(c, JSON_TOKEN_BEGIN_ARRAY,
+                              "$in expects an array of values")) {
+    return false;
+  }
+  if (c->lexer.type == JSON_TOKEN_END_ARRAY) {
+    return filter_compiler_emit_op(c, TOKEN_TYPE_FALSE) &&
+           json_lexer_next(&c->lexer);
+  }
+  for (size_t i = 0;; i++) {
+    if (c->lexer.type != JSON_TOKEN_STRING &&
+        c->lexer.type != JSON_TOKEN_NUMBER) {
+      c->lexer.error = "$in expects an array of values";
+      return false;
+    }
+    if (!filter_compiler_emit_leaf(c, path, exact_literal(c->lexer.text),
+                                   false) ||
+        (i != 0 && !filter_compiler_emit_op(c, TOKEN_TYPE_OP_OR)) ||
+        !json_lexer_next(&c->lexer)) {
+      return false;
+    }
+    if (c->lexer.type != JSON_TOKEN_COMMA) {
+      return filter_compiler_expect(c, JSON_TOKEN_END_ARRAY,
+                                    "Expected ',' or ']' in $in");
+    }
+    if (!json_lexer_next(&c->lexer)) {
+      return false;
+    }
+  }
+}
+
+// Compiles `key: value` of an object applied under path (NULL at the top)
+bool filter_compile_condition(FilterCompiler *c, const char *path,
+                              const char *key) {
+  JsonLexer *lexer = &c->lexer;
+  if (str_eq(key, "$and")) {
+    return filter_compile_array(c, path, TOKEN_TYPE_OP_AND);
+  }
+  if (str_eq(key, "$or")) {
+    return filter_compile_array(c, path, TOKEN_TYPE_OP_OR);
+  }
+  if (str_eq(key, "$not")) {
+    return filter_compile_object(c, path) &&
+           filter_compiler_emit_op(c, TOKEN_TYPE_OP_NOT);
+  }
+  if (str_eq(key, "$text")) {
+    if (lexer->type != JSON_TOKEN_STRING) {
+      lexer->error = "$text expects a string";
+      return false;
+    }
+    return filter_compiler_emit_leaf(c, NULL, strdup(lexer->text), false) &&
+           json_lexer_next(lexer);
+  }
+
+  if (key[0] == '$') {
+    if (path == NULL) {
+      lexer->error = "Field operators need a field";
+      return false;
+    }
+    bool is_value =
+        lexer->type == JSON_TOKEN_STRING || lexer->type == JSON_TOKEN_NUMBER;
+    if (str_eq(key, "$eq") || str_eq(key, "$ne")) {
+      if (!is_value) {
+        lexer->error = "$eq and $ne expect a value";
+        return false;
+      }
+      return filter_compiler_emit_leaf(c, path, exact_literal(lexer->text),
+                                       false) &&
+             (str_eq(key, "$eq") ||
+              filter_compiler_emit_op(c, TOKEN_TYPE_OP_NOT)) &&
+             json_lexer_next(lexer);
+    }
+    if (str_eq(key, "$regex")) {
+      if (lexer->type != JSON_TOKEN_STRING) {
+        lexer->error = "$regex expects a string";
+        return false;
+      }
+      return filter_compiler_emit_leaf(c, path, regex_literal(lexer->text),
+                                       false) &&
+             json_lexer_next(lexer);
+    }
+    if (str_eq(key, "$in")) {
+      return filter_compile_in(c, path);
+    }
+    if (str_eq(key, "$exists")) {
+      if (lexer->type != JSON_TOKEN_TRUE && lexer->type != JSON_TOKEN_FALSE) {
+        lexer->error = "$exists expects true or false";
+        return false;
+      }
+      return filter_compiler_emit_leaf(c, path, strdup("$exists"), true) &&
+             (lexer->type == JSON_TOKEN_TRUE ||
+              filter_compiler_emit_op(c, TOKEN_TYPE_OP_NOT)) &&
+             json_lexer_next(lexer);
+    }
+    lexer->error = "Unknown operator in filter";
+    return false;
+  }
+
+  char *field_path = malloc((path != NULL ? strlen(path) + 1 : 0) +
+                            strlen(key) + 1);
+  if (field_path == NULL) {
+    lexer->error = "Failed to allocate memory for filter";
+    return false;
+  }
+  if (path != NULL) {
+    sprintf(field_path, "%s.%s", path, key);
+  } else {
+    strcpy(field_path, key);
+  }
+  bool ok;
+  switch (lexer->type) {
+  case JSON_TOKEN_STRING:
+  case JSON_TOKEN_NUMBER:
+    ok = filter_compiler_emit_leaf(c, field_path, exact_literal(lexer->text),
+                                   false) &&
+         json_lexer_next(lexer);
+    break;
+  case JSON_TOKEN_BEGIN_OBJECT:
+    ok = filter_compile_object(c, field_path);
+    break;
+  default:
+    lexer->error = "Unsupported value in filter";
+    ok = false;
+  }
+  free(field_path);
+  return ok;
+}
+
+// Compiles an object whose conditions are all applied under path
+bool filter_compile_object_fields(FilterCompiler *c, const char *path) {
+  JsonLexer *lexer = &c->lexer;
+  if (!filter_compiler_expect(c, JSON_TOKEN_BEGIN_OBJECT,
+                              "Expected a filter object")) {
+    return false;
+  }
+  if (lexer->type == JSON_TOKEN_END_OBJECT) {
+    // the empty filter matches everything
+    return filter_compiler_emit_op(c, TOKEN_TYPE_TRUE) &&
+           json_lexer_next(lexer);
+  }
+  for (size_t i = 0;; i++) {
+    if (lexer->type != JSON_TOKEN_STRING) {
+      lexer->error = "Expected a key in filter";
+      return false;
+    }
+    char *key = strdup(lexer->text);
+    if (key == NULL) {
+      lexer->error = "Failed to allocate memory for filter";
+      return false;
+    }
+    bool ok = json_lexer_next(lexer) &&
+              filter_compiler_expect(c, JSON_TOKEN_COLON,
+                                     "Expected ':' after a key in filter") &&
+              filter_compile_condition(c, path, key) &&
+              (i == 0 || filter_compiler_emit_op(c, TOKEN_TYPE_OP_AND));
+    free(key);
+    if (!ok) {
+      return false;
+    }
+    if (lexer->type != JSON_TOKEN_COMMA) {
+      return filter_compiler_expect(c, JSON_TOKEN_END_OBJECT,
+                                    "Expected ',' or '}' in filter");
+    }
+    if (!json_lexer_next(lexer)) {
+      return false;
+    }
+  }
+}
+
+bool filter_compile_object(FilterCompiler *c, const char *path) {
+  if (c->depth == FILTER_MAX_DEPTH) {
+    c->lexer.error = "Filter nested too deeply";
+    return false;
+  }
+  c->depth++;
+  bool ok = filter_compile_object_fields(c, path);
+  c->depth--;
+  return ok;
+}
+
+bool filter_compiler_add_filter(FilterCompiler *c) {
+  c->output = token_list_init();
+  if (c->output == NULL) {
+    c->lexer.error = "Failed to allocate memory for filter";
+    return false;
+  }
+  if (!filter_compile_object(c, NULL)) {
+    token_list_destroy_shallow(c->output);
+    return false;
+  }
+  FilterBatch *batch = c->batch;
+  TokenList **new_filters =
+      realloc(batch->filters, (batch->filters_n + 1) * sizeof(TokenList *));
+  if (new_filters == NULL) {
+    c->lexer.error = "Failed to allocate memory for filter";
+    token_list_destroy_shallow(c->output);
+    return false;
+  }
+  batch->filters = new_filters;
+  batch->filters[batch->filters_n++] = c->output;
+  return true;
+}
+
+/*
+ * Compiles a JSON filter, or an array of them, into an empty batch. On
+ * failure prints the reason; the batch has to be destroyed either way.
+ */
+bool filter_batch_compile(FilterBatch *batch, const char *json) {
+  FilterCompiler c = {
+      .lexer = {.s = json}, .batch = batch, .output = NULL, .depth = 0};
+  JsonLexer *lexer = &c.lexer;
+  bool ok = json_lexer_next(lexer);
+  if (ok && lexer->type == JSON_TOKEN_BEGIN_ARRAY) {
+    ok = json_lexer_next(lexer);
+    while (ok) {
+      ok = filter_compiler_add_filter(&c);
+      if (ok && lexer->type != JSON_TOKEN_COMMA) {
+        ok = filter_compiler_expect(&c, JSON_TOKEN_END_ARRAY,
+                                    "Expected ',' or ']' in filters");
+        break;
+      }
+      ok = ok && json_lexer_next(lexer);
+    }
+  } else if (ok) {
+    ok = filter_compiler_add_filter(&c);
+  }
+  if (ok && lexer->type != JSON_TOKEN_END) {
+    lexer->error = "Unexpected text after filter";
+    ok = false;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s (near offset %zu of the filter)\n", lexer->error,
+            (size_t)(lexer->s - json));
+  }
+  free(lexer->text);
+  return ok;
+}
+
+/*
+ * Compressed storage.
+ *
+ * In compressed mode (--compressed) entries are packed into blocks of
+ * COMPRESSED_BLOCK_ENTRIES_N as soon as there are enough of them. A block
+ * keeps its entries as NUL-terminated strings followed by their encoded
+ * documents (a zero u32 for an entry that is not a document), compressed
+ * with a small LZ77 codec (LZ4-like sequences of literals followed by a
+ * back-reference), and a bloom filter of the lowercased trigrams of its
+ * entries. Search consults
+ * the bloom filter first and decompresses only blocks that might match.
+ * The newest entries, fewer than a block, stay uncompressed in `entries`,
+ * and sealed blocks are always full: entry i lives in block
+ * i / COMPRESSED_BLOCK_ENTRIES_N unless it is in that uncompressed tail.
+ */
+
+#define COMPRESSED_BLOCK_ENTRIES_N 64
+#define BLOCK_SUMMARY_BITS 4096
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+_Static_assert(COMPRESSED_BLOCK_ENTRIES_N <= MAX_ENTRIES_N,
+               "a block must fit into the uncompressed tail");
+
+typedef struct {
+  unsigned char *data;
+  size_t data_size;
+  size_t raw_size;  // decompressed, the text and then the documents
+  size_t text_size; // of the entries alone
+  size_t entries_n;
+  size_t documents_n;
+  unsigned char summary[BLOCK_SUMMARY_BITS / 8]; // bloom filter of trigrams
+} CompressedBlock;
+
+bool compressed_mode = false;
+CompressedBlock *blocks = NULL;
+size_t blocks_n = 0;
+
+// shared by all blocks, so that scanning does not allocate per block
+char *block_buffer = NULL;
+size_t block_buffer_cap = 0;
+
+bool block_buffer_reserve(size_t size) {
+  if (size <= block_buffer_cap) {
+    return true;
+  }
+  char *new_buffer = realloc(block_buffer, size);
+  if (new_buffer == NULL) {
+    fprintf(stderr, "Failed to allocate memory for block buffer!\n");
+    return false;
+  }
+  block_buffer = new_buffer;
+  block_buffer_cap = size;
+  return true;
+}
+
+size_t lz_compress_bound(size_t n) { return n + n / 255 + 16; }
+
+size_t lz_emit_length(unsigned char *dst, size_t out, size_t len) {
+  // the first 15 are stored in the token nibble
+  for (len -= 15; len >= 255; len -= 255) {
+    dst[out++] = 255;
+  }
+  dst[out++] = len;
+  return out;
+}
+
+// match_len == 0 means that this is the last sequence, literals only
+size_t lz_emit_sequence(unsigned char *dst, size_t out,
+                        const unsigned char *literals, size_t literals_n,
+                        size_t offset, size_t match_len) {
+  size_t match_code = match_len == 0 ? 0 : match_len - LZ_MIN_MATCH;
+  dst[out++] = (literals_n < 15 ? literals_n : 15) << 4 |
+               (match_code < 15 ? match_code : 15);
+  if (literals_n >= 15) {
+    out = lz_emit_length(dst, out, literals_n);
+  }
+  memcpy(dst + out, literals, literals_n);
+  out += literals_n;
+  if (match_len != 0) {
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    if (match_code >= 15) {
+      out = lz_emit_length(dst, out, match_code);
+    }
+  }
+  return out;
+}
+
+// dst must hold at least lz_compress_bound(n) bytes
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst) {
+  uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes
+  size_t anchor = 0;
+  size_t out = 0;
+  size_t i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    uint32_t sequence;
+    memcpy(&sequence, src + i, sizeof(sequence));
+    uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[hash];
+    table[hash] = i + 1;
+    if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET ||
+        memcmp(src + candidate - 1, src + i, LZ_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    size_t match = candidate - 1;
+    size_t match_len = LZ_MIN_MATCH;
+    while (i + match_len < n && src[match + match_len] == src[i + match_len]) {
+      match_len++;
+    }
+    out = lz_emit_sequence(dst, out, src + anchor, i - anchor, i - match,
+                           match_len);
+    i += match_len;
+    anchor = i;
+  }
+  return lz_emit_sequence(dst, out, src + anchor, n - anchor, 0, 0);
+}
+
+size_t lz_read_length(const unsigned char *src, size_t *in, size_t n,
+                      size_t len) {
+  if (len != 15) {
+    return len;
+  }
+  while (*in < n) {
+    unsigned char b = src[(*in)++];
+    len += b;
+    if (b != 255) {
+      break;
+    }
+  }
+  return len;
+}
+
+// Returns the number of bytes written, or (size_t)-1 on corrupted input
+size_t lz_decompress(const unsigned char *src, size_t n, unsigned char *dst,
+                     size_t dst_cap) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < n) {
+    unsigned char token = src[in++];
+    size_t literals_n = lz_read_length(src, &in, n, token >> 4);
+    if (literals_n > n - in || literals_n > dst_cap - out) {
+      return (size_t)-1;
+    }
+    memcpy(dst + out, src + in, literals_n);
+    in += literals_n;
+    out += literals_n;
+    if (in == n) {
+      break;
+    }
+    if (n - in < 2) {
+      return (size_t)-1;
+    }
+    size_t offset = src[in] | src[in + 1] << 8;
+    in += 2;
+    size_t match_len =
+        lz_read_length(src, &in, n, token & 0x0f) + LZ_MIN_MATCH;
+    if (offset == 0 || offset > out || match_len > dst_cap - out) {
+      return (size_t)-1;
+    }
+    // byte by byte: the match may overlap with what it produces
+    for (size_t i = 0; i < match_len; i++, out++) {
+      dst[out] = dst[out - offset];
+    }
+  }
+  return out;
+}
+
+uint32_t trigram_hash(const char *s) {
+  uint32_t trigram = (unsigned char)tolower(s[0]) |
+                     (unsigned char)tolower(s[1]) << 8 |
+                     (unsigned char)tolower(s[2]) << 16;
+  return trigram * 2654435761u;
+}
+
+void block_summary_add(unsigned char *summary, const char *s) {
+  for (; s[0] != '\0' && s[1] != '\0' && s[2] != '\0'; s++) {
+    uint32_t hash = trigram_hash(s);
+    size_t bit1 = hash % BLOCK_SUMMARY_BITS;
+    size_t bit2 = (hash >> 16) % BLOCK_SUMMARY_BITS;
+    summary[bit1 / 8] |= 1 << (bit1 % 8);
+    summary[bit2 / 8] |= 1 << (bit2 % 8);
+  }
+}
+
+// false means that no entry of the block contains s
+bool block_summary_may_contain(const unsigned char *summary, const char *s) {
+  for (; s[0] != '\0' && s[1] != '\0' && s[2] != '\0'; s++) {
+    uint32_t hash = trigram_hash(s);
+    size_t bit1 = hash % BLOCK_SUMMARY_BITS;
+    size_t bit2 = (hash >> 16) % BLOCK_SUMMARY_BITS;
+    if ((summary[bit1 / 8] & (1 << (bit1 % 8))) == 0 ||
+        (summary[bit2 / 8] & (1 << (bit2 % 8))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// block_documents holds the encodings of the entries and may be NULL
+bool compressed_block_init(CompressedBlock *block, char *const *block_entries,
+                           unsigned char *const *block_documents,
+                           size_t block_entries_n) {
+  memset(block, 0, sizeof(CompressedBlock));
+  size_t text_size = 0;
+  size_t raw_size = 0;
+  for (size_t i = 0; i < block_entries_n; i++) {
+    text_size += strlen(block_entries[i]) + 1;
+    const unsigned char *document =
+        block_documents != NULL ? block_documents[i] : NULL;
+    raw_size += document != NULL ? read_u32(document) : 4;
+  }
+  raw_size += text_size;
+  if (!block_buffer_reserve(raw_size)) {
+    return false;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < block_entries_n; i++) {
+    size_t size = strlen(block_entries[i]) + 1;
+    memcpy(block_buffer + offset, block_entries[i], size);
+    offset += size;
+    block_summary_add(block->summary, block_entries[i]);
+  }
+  for (size_t i = 0; i < block_entries_n; i++) {
+    const unsigned char *document =
+        block_documents != NULL ? block_documents[i] : NULL;
+    if (document != NULL) {
+      memcpy(block_buffer + offset, document, read_u32(document));
+      offset += read_u32(document);
+      block->documents_n++;
+    } else {
+      write_u32((unsigned char *)block_buffer + offset, 0);
+      offset += 4;
+    }
+  }
+
+  unsigned char *data = malloc(lz_compress_bound(raw_size));
+  if (data == NULL) {
+    fprintf(stderr, "Failed to allocate memory for compressed block!\n");
+    return false;
+  }
+  size_t data_size =
+      lz_compress((const unsigned char *)block_buffer, raw_size, data);
+  unsigned char *shrunk = realloc(data, data_size);
+  block->data = shrunk != NULL ? shrunk : data;
+  block->data_size = data_size;
+  block->raw_size = raw_size;
+  block->text_size = text_size;
+  block->entries_n = block_entries_n;
+  return true;
+}
+
+// Returns the entries one after another in block_buffer, or NULL
+const char *compressed_block_decompress(const CompressedBlock *block) {
+  if (!block_buffer_reserve(block->raw_size)) {
+    return NULL;
+  }
+  size_t raw_size =
+      lz_decompress(block->data, block->data_size,
+                    (unsigned char *)block_buffer, block->raw_size);
+  if (raw_size != block->raw_size) {
+    fprintf(stderr, "Corrupted compressed block!\n");
+    return NULL;
+  }
+  return block_buffer;
+}
+
+// Copies the entries of a block out, so that block_buffer can be reused
+// Returns the encoded document at *cursor (NULL if the entry is not a
+// document) and moves the cursor to the one of the next entry
+const unsigned char *block_next_document(const unsigned char **cursor) {
+  uint32_t size = read_u32(*cursor);
+  if (size == 0) {
+    *cursor += 4;
+    return NULL;
+  }
+  const unsigned char *document = *cursor;
+  *cursor += size;
+  return document;
+}
+
+// Copies the entries and their encoded documents out of the block
+bool compressed_block_unpack(const CompressedBlock *block,
+                             char **block_entries,
+                             unsigned char **block_documents) {
+  const char *entry = compressed_block_decompress(block);
+  if (entry == NULL) {
+    return false;
+  }
+  const unsigned char *cursor =
+      (const unsigned char *)entry + block->text_size;
+  for (size_t i = 0; i < block->entries_n; i++) {
+    const unsigned char *document = block_next_document(&cursor);
+    block_entries[i] = strdup(entry);
+    block_documents[i] = document != NULL ? malloc(read_u32(document)) : NULL;
+    if (block_entries[i] == NULL ||
+        (document != NULL && block_documents[i] == NULL)) {
+      fprintf(stderr, "Failed to allocate memory for entry!\n");
+      do {
+        free(block_entries[i]);
+        block_entries[i] = NULL;
+        free(block_documents[i]);
+        block_documents[i] = NULL;
+      } while (i-- > 0);
+      return false;
+    }
+    if (document != NULL) {
+      memcpy(block_documents[i], document, read_u32(document));
+    }
+    entry += strlen(entry) + 1;
+  }
+  return true;
+}
 
+/*
+ * Evaluates the postfixed predicate against the summary of a block using
+ * three-valued logic: a literal is either surely absent from every entry of
+ * the block or maybe present. Returns false only when no entry can match.
+ * stack is scratch space for at least pf_list->tokens_n values.
+ */
+bool compressed_block_may_match(const CompressedBlock *block,
+                                const TokenList *const pf_list, int *stack) {
+  enum { NO, MAYBE, YES };
+  size_t stack_n = 0;
   for (size_t i = 0; i < pf_list->tokens_n; i++) {
-    Token current_tok = pf_list->tokens[i];
-    switch (current_tok.type) {
-    case TOKEN_TYPE_STR:
-      token_list_push(stack, current_tok);
+    Token token = pf_list->tokens[i];
+    switch (token.type) {
+    case TOKEN_TYPE_STR: {
+      const char *required =
+          token.pattern != NULL ? token.pattern->required : token.str;
+      // a field value may be spelled differently in the text (quotes)
+      stack[stack_n++] =
+          token.path != NULL || required == NULL ||
+                  block_summary_may_contain(block->summary, required)
+              ? MAYBE
+              : NO;
       break;
-    case TOKEN_TYPE_OP_NOT: {
-      Token stack_token = token_list_pop(stack);
-      if (stack_token.type == TOKEN_TYPE_STR) {
-        bool str_of_token_found = strcasestr(str, stack_token.str) != NULL;
-        token_list_push(stack,
-                        (Token){.type = (str_of_token_found) ? TOKEN_TYPE_FALSE
-                                                             : TOKEN_TYPE_TRUE,
-                                .str = NULL});
-      } else if (stack_token.type == TOKEN_TYPE_TRUE) {
-        token_list_push(stack, (Token){.type = TOKEN_TYPE_FALSE, .str = NULL});
-      } else if (stack_token.type == TOKEN_TYPE_FALSE) {
-        token_list_push(stack, (Token){.type = TOKEN_TYPE_TRUE, .str = NULL});
+    }
+    case TOKEN_TYPE_TRUE:
+      stack[stack_n++] = YES;
+      break;
+    case TOKEN_TYPE_FALSE:
+      stack[stack_n++] = NO;
+      break;
+    case TOKEN_TYPE_OP_NOT:
+      if (stack_n == 0) {
+        return true;
+      }
+      stack[stack_n - 1] = YES - stack[stack_n - 1];
+      break;
+    case TOKEN_TYPE_OP_AND:
+    case TOKEN_TYPE_OP_OR: {
+      if (stack_n < 2) {
+        return true;
+      }
+      int op2 = stack[--stack_n];
+      int op1 = stack[stack_n - 1];
+      if (token.type == TOKEN_TYPE_OP_AND) {
+        stack[stack_n - 1] = op1 < op2 ? op1 : op2;
       } else {
-        fprintf(stderr, "Unexpected token type: %d\n", stack_token.type);
-        assert(false);
+        stack[stack_n - 1] = op1 > op2 ? op1 : op2;
       }
       break;
     }
-    case TOKEN_TYPE_OP_OR:
-    case TOKEN_TYPE_OP_AND: {
-      Token op2 = token_list_pop(stack);
-      Token op1 = token_list_pop(stack);
+    default:
+      break;
+    }
+  }
+  return stack_n != 1 || stack[0] != NO;
+}
+
+bool has_candidates(const bool *candidates, size_t first, size_t n) {
+  if (candidates == NULL) {
+    return true;
+  }
+  for (size_t i = first; i < first + n; i++) {
+    if (candidates[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// first is the entry number of the first entry of the block
+bool filter_batch_may_match_block(const FilterBatch *batch,
+                                  const CompressedBlock *block, size_t first) {
+  for (size_t i = 0; i < batch->filters_n; i++) {
+    if (has_candidates(batch->candidates[i], first, block->entries_n) &&
+        compressed_block_may_match(block, batch->filters[i],
+                                   batch->block_stack)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Returns the number of entries matching any filter of the prepared batch,
+ * printing them if asked to.
+ */
+size_t compressed_blocks_search(const CompressedBlock *search_blocks,
+                                size_t search_blocks_n, FilterBatch *batch,
+                                bool print) {
+  size_t matches_n = 0;
+  size_t index = 0;
+  for (size_t i = 0; i < search_blocks_n; i++) {
+    const CompressedBlock *block = &search_blocks[i];
+    if (!filter_batch_may_match_block(batch, block, index)) {
+      index += block->entries_n;
+      continue;
+    }
+    const char *entry = compressed_block_decompress(block);
+    if (entry == NULL) {
+      index += block->entries_n;
+      continue;
+    }
+    const unsigned char *cursor =
+        (const unsigned char *)entry + block->text_size;
+    for (size_t j = 0; j < block->entries_n; j++, index++) {
+      const unsigned char *document = block_next_document(&cursor);
+      if (filter_batch_eval_entry(batch, index, entry, document)) {
+        matches_n++;
+        if (print) {
+          filter_batch_print_entry(batch, index, entry);
+        }
+      }
+      entry += strlen(entry) + 1;
+    }
+  }
+  return matches_n;
+}
+
+size_t storage_entries_n(void) {
+  return blocks_n * COMPRESSED_BLOCK_ENTRIES_N + entries_n;
+}
+
+bool storage_is_full(void) { return entries_n == MAX_ENTRIES_N; }
+
+// Takes ownership of entry, which is freed if it is a malformed document
+bool storage_add(char *entry) {
+  assert(!storage_is_full());
+  unsigned char *document = NULL;
+  if (is_document_text(entry)) {
+    const char *error;
+    document = document_from_text(entry, &error);
+    if (document == NULL) {
+      fprintf(stderr, "%s: %s\n", error, entry);
+      free(entry);
+      return false;
+    }
+  }
+  size_t entry_number = storage_entries_n();
+  if (document != NULL) {
+    char *path = malloc(read_u32(document));
+    if (path == NULL) {
+      fprintf(stderr, "Failed to allocate memory for path!\n");
+      free(document);
+      free(entry);
+      return false;
+    }
+    if (!path_index_update(document, path, path_index_add_posting,
+                           &entry_number)) {
+      // rolling back the postings added so far
+      path_index_update(document, path, path_index_remove_posting,
+                        &entry_number);
+      free(path);
+      free(document);
+      free(entry);
+      return false;
+    }
+    free(path);
+  }
+
+  entry_documents[entries_n] = document;
+  entries[entries_n++] = entry;
+  if (!compressed_mode || entries_n < COMPRESSED_BLOCK_ENTRIES_N) {
+    return true;
+  }
+  CompressedBlock *new_blocks =
+      realloc(blocks, (blocks_n + 1) * sizeof(CompressedBlock));
+  if (new_blocks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for blocks!\n");
+    return true;
+  }
+  blocks = new_blocks;
+  // only full blocks are sealed: if an earlier seal failed, the tail
+  // is longer and the rest of it waits for the next one
+  if (!compressed_block_init(&blocks[blocks_n], entries, entry_documents,
+                             COMPRESSED_BLOCK_ENTRIES_N)) {
+    // keeping the entries uncompressed then
+    return true;
+  }
+  blocks_n++;
+  for (size_t i = 0; i < COMPRESSED_BLOCK_ENTRIES_N; i++) {
+    free(entries[i]);
+    free(entry_documents[i]);
+  }
+  entries_n -= COMPRESSED_BLOCK_ENTRIES_N;
+  memmove(entries, entries + COMPRESSED_BLOCK_ENTRIES_N,
+          entries_n * sizeof(char *));
+  memset(entries + entries_n, 0, COMPRESSED_BLOCK_ENTRIES_N * sizeof(char *));
+  memmove(entry_documents, entry_documents + COMPRESSED_BLOCK_ENTRIES_N,
+          entries_n * sizeof(unsigned char *));
+  memset(entry_documents + entries_n, 0,
+         COMPRESSED_BLOCK_ENTRIES_N * sizeof(unsigned char *));
+  return true;
+}
+
+/*
+ * Moves the last entry into the place of the deleted one, just like the
+ * uncompressed storage does.
+ */
+bool storage_del_string(size_t entry_number) {
+  if (entries_n == 0) {
+    // the last entry is in a block: unpacking it into the tail
+    assert(blocks_n != 0);
+    if (!compressed_block_unpack(&blocks[blocks_n - 1], entries,
+                                 entry_documents)) {
+      return false;
+    }
+    entries_n = blocks[blocks_n - 1].entries_n;
+    free(blocks[--blocks_n].data);
+  }
+
+  size_t tail_start = blocks_n * COMPRESSED_BLOCK_ENTRIES_N;
+  if (entry_number >= tail_start) {
+    entry_number -= tail_start;
+    free(entries[entry_number]);
+    entries[entry_number] = entries[entries_n - 1];
+    entries[entries_n - 1] = NULL;
+    free(entry_documents[entry_number]);
+    entry_documents[entry_number] = entry_documents[entries_n - 1];
+    entry_documents[entries_n - 1] = NULL;
+    entries_n--;
+    return true;
+  }
+
+  CompressedBlock *block = &blocks[entry_number / COMPRESSED_BLOCK_ENTRIES_N];
+  char *block_entries[COMPRESSED_BLOCK_ENTRIES_N];
+  unsigned char *block_documents[COMPRESSED_BLOCK_ENTRIES_N];
+  if (!compressed_block_unpack(block, block_entries, block_documents)) {
+    return false;
+  }
+  size_t block_entries_n = block->entries_n;
+  size_t slot = entry_number % COMPRESSED_BLOCK_ENTRIES_N;
+  free(block_entries[slot]);
+  free(block_documents[slot]);
+  block_entries[slot] = entries[entries_n - 1];
+  block_documents[slot] = entry_documents[entries_n - 1];
+  CompressedBlock new_block;
+  bool ok = compressed_block_init(&new_block, block_entries, block_documents,
+                                  block_entries_n);
+  if (ok) {
+    free(block->data);
+    *block = new_block;
+    entries[--entries_n] = NULL;
+    entry_documents[entries_n] = NULL;
+  } else {
+    // still owned by the tail
+    block_entries[slot] = NULL;
+    block_documents[slot] = NULL;
+  }
+  for (size_t i = 0; i < block_entries_n; i++) {
+    free(block_entries[i]);
+    free(block_documents[i]);
+  }
+  return ok;
+}
+
+/*
+ * Sets *document to a copy of the encoding of the entry, or to NULL if it is
+ * not a document.
+ */
+bool storage_copy_document(size_t entry_number, unsigned char **document) {
+  *document = NULL;
+  const unsigned char *encoding;
+  size_t tail_start = blocks_n * COMPRESSED_BLOCK_ENTRIES_N;
+  if (entry_number >= tail_start) {
+    encoding = entry_documents[entry_number - tail_start];
+  } else {
+    const CompressedBlock *block =
+        &blocks[entry_number / COMPRESSED_BLOCK_ENTRIES_N];
+    const char *entry = compressed_block_decompress(block);
+    if (entry == NULL) {
+      return false;
+    }
+    const unsigned char *cursor =
+        (const unsigned char *)entry + block->text_size;
+    encoding = NULL;
+    for (size_t i = 0; i <= entry_number % COMPRESSED_BLOCK_ENTRIES_N; i++) {
+      encoding = block_next_document(&cursor);
+    }
+  }
+  if (encoding == NULL) {
+    return true;
+  }
+  *document = malloc(read_u32(encoding));
+  if (*document == NULL) {
+    fprintf(stderr, "Failed to allocate memory for document!\n");
+    return false;
+  }
+  memcpy(*document, encoding, read_u32(encoding));
+  return true;
+}
+
+bool storage_del(size_t entry_number) {
+  if (entry_number >= storage_entries_n()) {
+    return false;
+  }
+  size_t last = storage_entries_n() - 1;
+  unsigned char *document = NULL;
+  unsigned char *last_document = NULL;
+  char *path = NULL;
+  bool ok = storage_copy_document(entry_number, &document) &&
+            (entry_number == last ||
+             storage_copy_document(last, &last_document));
+  if (ok) {
+    // allocating before anything changes, the postings can then be
+    // updated without failing
+    size_t path_size = 1;
+    if (document != NULL && read_u32(document) > path_size) {
+      path_size = read_u32(document);
+    }
+    if (last_document != NULL && read_u32(last_document) > path_size) {
+      path_size = read_u32(last_document);
+    }
+    path = malloc(path_size);
+    if (path == NULL) {
+      fprintf(stderr, "Failed to allocate memory for path!\n");
+    }
+    ok = path != NULL && storage_del_string(entry_number);
+  }
+  if (ok && document != NULL) {
+    path_index_update(document, path, path_index_remove_posting,
+                      &entry_number);
+  }
+  if (ok && last_document != NULL) {
+    size_t from_to[] = {last, entry_number};
+    path_index_update(last_document, path, path_index_renumber_posting,
+                      from_to);
+  }
+  free(path);
+  free(document);
+  free(last_document);
+  return ok;
+}
 
-      bool op1_result;
-      if (op1.type == TOKEN_TYPE_STR) {
-        op1_result = strcasestr(str, op1.str) != NULL;
-      } else {
-        assert(op1.type == TOKEN_TYPE_TRUE || op1.type == TOKEN_TYPE_FALSE);
-        op1_result = op1.type == TOKEN_TYPE_TRUE;
+// Returns the number of entries matching any filter of the prepared batch
+size_t storage_search_batch(FilterBatch *batch, bool print) {
+  size_t matches_n = compressed_blocks_search(blocks, blocks_n, batch, print);
+  size_t tail_start = blocks_n * COMPRESSED_BLOCK_ENTRIES_N;
+  for (size_t i = 0; i < entries_n; i++) {
+    size_t entry_number = tail_start + i;
+    if (filter_batch_eval_entry(batch, entry_number, entries[i],
+                                entry_documents[i])) {
+      matches_n++;
+      if (print) {
+        filter_batch_print_entry(batch, entry_number, entries[i]);
       }
+    }
+  }
+  return matches_n;
+}
 
-      bool op2_result;
-      if (op2.type == TOKEN_TYPE_STR) {
-        op2_result = strcasestr(str, op2.str) != NULL;
-      } else {
-        assert(op2.type == TOKEN_TYPE_TRUE || op2.type == TOKEN_TYPE_FALSE);
-        op2_result = op2.type == TOKEN_TYPE_TRUE;
-      }
+// Returns the number of matching entries, printing them if asked to
+size_t storage_search(const TokenList *const pf_list, bool print) {
+  if (pf_list == NULL) {
+    return 0;
+  }
+  TokenList *filters[] = {(TokenList *)pf_list};
+  FilterBatch batch = {.filters = filters, .filters_n = 1};
+  if (!filter_batch_prepare(&batch, storage_entries_n())) {
+    return 0;
+  }
+  size_t matches_n = storage_search_batch(&batch, print);
+  filter_batch_release(&batch);
+  return matches_n;
+}
 
-      bool new_value;
-      if (current_tok.type == TOKEN_TYPE_OP_OR) {
-        new_value = op1_result || op2_result;
-      } else {
-        new_value = op1_result && op2_result;
-      }
-      token_list_push(stack, (Token){.type = (new_value) ? TOKEN_TYPE_TRUE
-                                                         : TOKEN_TYPE_FALSE,
-                                     .str = NULL});
-      break;
+void storage_list(void) {
+  size_t index = 0;
+  for (size_t i = 0; i < blocks_n; i++) {
+    const char *entry = compressed_block_decompress(&blocks[i]);
+    if (entry == NULL) {
+      index += blocks[i].entries_n;
+      continue;
     }
-    default:
-      printf("Unknown token type: %d\n", current_tok.type);
-      assert(false);
+    for (size_t j = 0; j < blocks[i].entries_n; j++, index++) {
+      printf("%zu) %s\n", index, entry);
+      entry += strlen(entry) + 1;
     }
   }
+  for (size_t i = 0; i < entries_n; i++, index++) {
+    printf("%zu) %s\n", index, entries[i]);
+  }
+}
 
-  assert(stack->tokens_n == 1);
-  bool result = stack->tokens[0].type == TOKEN_TYPE_TRUE;
-  token_list_destroy_shallow(stack);
-  return result;
+void storage_print_stats(void) {
+  size_t raw_size = 0;
+  size_t stored_size = 0;
+  size_t documents_n = 0;
+  size_t documents_size = 0;
+  for (size_t i = 0; i < blocks_n; i++) {
+    // the compressed data holds the encoded documents too
+    raw_size += blocks[i].text_size;
+    stored_size += blocks[i].data_size + sizeof(blocks[i].summary);
+    documents_n += blocks[i].documents_n;
+    documents_size += blocks[i].raw_size - blocks[i].text_size -
+                      4 * (blocks[i].entries_n - blocks[i].documents_n);
+  }
+  size_t tail_documents_size = 0;
+  for (size_t i = 0; i < entries_n; i++) {
+    raw_size += strlen(entries[i]) + 1;
+    stored_size += strlen(entries[i]) + 1;
+    if (entry_documents[i] != NULL) {
+      documents_n++;
+      tail_documents_size += read_u32(entry_documents[i]);
+    }
+  }
+  documents_size += tail_documents_size;
+  stored_size += tail_documents_size;
+  printf("Mode: %s\n", compressed_mode ? "compressed" : "uncompressed");
+  printf("Entries: %zu (%zu in compressed blocks)\n", storage_entries_n(),
+         blocks_n * COMPRESSED_BLOCK_ENTRIES_N);
+  printf("Raw bytes: %zu, stored bytes: %zu", raw_size, stored_size);
+  if (stored_size != 0) {
+    printf(", ratio: %.2f", (double)raw_size / stored_size);
+  }
+  printf("\n");
+  size_t index_size = paths_cap * sizeof(PathPostings);
+  for (size_t i = 0; i < paths_n; i++) {
+    index_size +=
+        strlen(paths[i].path) + 1 + paths[i].postings_cap * sizeof(size_t);
+  }
+  printf("Documents: %zu (%zu encoded bytes before compression)\n",
+         documents_n, documents_size);
+  printf("Indexed paths: %zu (%zu bytes)\n", paths_n, index_size);
+}
 
-cleanup:
-  token_list_destroy_shallow(stack);
-  return false;
+void storage_destroy(void) {
+  for (size_t i = 0; i < MAX_ENTRIES_N; i++) {
+    free(entries[i]);
+    entries[i] = NULL;
+    free(entry_documents[i]);
+    entry_documents[i] = NULL;
+  }
+  entries_n = 0;
+  for (size_t i = 0; i < blocks_n; i++) {
+    free(blocks[i].data);
+  }
+  free(blocks);
+  blocks = NULL;
+  blocks_n = 0;
+  path_index_destroy();
+  free(block_buffer);
+  block_buffer = NULL;
+  block_buffer_cap = 0;
 }
 
 void run_tests(void) {
@@ -584,12 +3657,744 @@ void run_tests(void) {
     token_list_destroy_shallow(pf_list);
     token_list_destroy_deep(token_list);
   }
+  {
+    TokenList *token_list = tokenize("^alice | wonder*land$ & !b?b");
+    assert(token_list->tokens_n == 6);
+    assert(token_list->tokens[0].pattern != NULL);
+    assert(str_eq(token_list->tokens[0].str, "^alice"));
+    assert(token_list->tokens[2].pattern != NULL);
+    assert(str_eq(token_list->tokens[2].pattern->required, "wonder"));
+    assert(token_list->tokens[5].pattern != NULL);
+
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "Alice in Wonderland"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "Not Alice"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "Wonder of a land"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "Wonderland fans"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "Bob in Wonderland"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "BIB's wonderland"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "Bb in Wonderland"));
+
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    TokenList *token_list = tokenize("/^(ab|c)+d[0-9]*$/ | /x(y|z)?w+/ ");
+    assert(token_list->tokens_n == 3);
+    assert(str_eq(token_list->tokens[0].str, "/^(ab|c)+d[0-9]*$/"));
+    assert(token_list->tokens[0].pattern->anchored_start);
+    assert(token_list->tokens[0].pattern->anchored_end);
+    assert(str_eq(token_list->tokens[0].pattern->required, "d"));
+    assert(str_eq(token_list->tokens[2].pattern->required, "x"));
+
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "abcABd42"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "cd"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "d"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "abd42a"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "... xw ..."));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "... xZwww"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "... xyzw"));
+
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    // each top-level branch has its own anchors
+    TokenList *token_list = tokenize("/^a|b/");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "xb"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "ax"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "xa"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+
+    token_list = tokenize("/a$|^b/ & /c|d$/");
+    pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "xca"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "bxd"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "cax"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "bdx"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+
+    assert(tokenize("/a|b^c/") == NULL);
+
+    for (size_t depth = REGEX_MAX_DEPTH; depth <= REGEX_MAX_DEPTH + 1;
+         depth++) {
+      char regex[2 * (REGEX_MAX_DEPTH + 1) + 4];
+      size_t len = 0;
+      regex[len++] = '/';
+      memset(regex + len, '(', depth);
+      len += depth;
+      regex[len++] = 'a';
+      memset(regex + len, ')', depth);
+      len += depth;
+      regex[len++] = '/';
+      regex[len] = '\0';
+      token_list = tokenize(regex);
+      assert((token_list != NULL) == (depth == REGEX_MAX_DEPTH));
+      token_list_destroy_deep(token_list);
+    }
+    assert(tokenize("/(^a)/") == NULL);
+  }
+  {
+    // stacked quantifiers keep an atom required only if none is optional
+    TokenList *token_list = tokenize("/xab+?/ & /xa+*y/ | /zc*+d/");
+    assert(str_eq(token_list->tokens[0].pattern->required, "xa"));
+    assert(str_eq(token_list->tokens[2].pattern->required, "x"));
+    assert(str_eq(token_list->tokens[4].pattern->required, "z"));
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "xa xy"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "zd"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "zccd"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "xa"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    // the DFA of this one has far more states than the cache can hold
+    TokenList *token_list = tokenize("/a.......b$/");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(str_eq(token_list->tokens[0].pattern->required, "a"));
+    char entry[2001];
+    unsigned int seed = 42;
+    for (size_t i = 0; i < sizeof(entry) - 1; i++) {
+      seed = seed * 1103515245 + 12345;
+      entry[i] = (seed >> 16) % 2 ? 'a' : 'b';
+    }
+    entry[sizeof(entry) - 1] = '\0';
+    entry[sizeof(entry) - 10] = 'a';
+    entry[sizeof(entry) - 2] = 'b';
+    assert(eval_postfixed_tokens_as_predicate(pf_list, entry));
+    entry[sizeof(entry) - 2] = 'a';
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, entry));
+    assert(token_list->tokens[0].pattern->dfa_states_n <= DFA_CACHE_MAX_STATES);
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    assert(tokenize("/a(b/") == NULL);
+    assert(tokenize("/a^b/") == NULL);
+    assert(tokenize("/*a/") == NULL);
+    assert(tokenize("/[a-/") == NULL);
+
+    TokenList *token_list = tokenize("1\\*2 | /a\\/b/");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "1*2"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "12"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "a/b"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    // '\' only escapes metacharacters, so paths keep their backslashes
+    TokenList *token_list = tokenize("C:\\Users & 5\\$ & \\^x\\\\y");
+    assert(token_list->tokens[0].pattern == NULL);
+    assert(str_eq(token_list->tokens[0].str, "C:\\Users"));
+    assert(token_list->tokens[2].pattern == NULL);
+    assert(str_eq(token_list->tokens[2].str, "5$"));
+    assert(str_eq(token_list->tokens[4].str, "^x\\y"));
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(
+        eval_postfixed_tokens_as_predicate(pf_list, "C:\\Users\\bob 5$ ^x\\y"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "C:Users 5$ ^x\\y"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+
+    token_list = tokenize("C:\\Users*");
+    assert(token_list->tokens[0].pattern != NULL);
+    pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "C:\\Users\\bob"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "C:Users"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    // a '/' that does not close the token is plain text
+    TokenList *token_list = tokenize("/usr | /usr/bin | /abc/ def");
+    assert(token_list->tokens_n == 5);
+    assert(token_list->tokens[0].pattern == NULL);
+    assert(str_eq(token_list->tokens[2].str, "/usr/bin"));
+    assert(token_list->tokens[2].pattern == NULL);
+    assert(str_eq(token_list->tokens[4].str, "/abc/ def"));
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "cd /usr/local"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "ls /abc/ def"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "usr"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+  {
+    const char *raw =
+        "abcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabc"
+        "abcabcabcabcabcabcabcabcabcabcabcabcabcabcabcabc, xyz";
+    size_t raw_size = strlen(raw) + 1;
+    unsigned char compressed[256];
+    unsigned char decompressed[256];
+    assert(lz_compress_bound(raw_size) <= sizeof(compressed));
+    size_t compressed_size =
+        lz_compress((const unsigned char *)raw, raw_size, compressed);
+    assert(compressed_size < raw_size / 4);
+    assert(lz_decompress(compressed, compressed_size, decompressed,
+                         sizeof(decompressed)) == raw_size);
+    assert(str_eq((const char *)decompressed, raw));
+    assert(lz_decompress(compressed, compressed_size, decompressed, 10) ==
+           (size_t)-1);
+
+    compressed_size = lz_compress((const unsigned char *)"", 0, compressed);
+    assert(lz_decompress(compressed, compressed_size, decompressed,
+                         sizeof(decompressed)) == 0);
+  }
+  {
+    char *block_entries[] = {"Alice in Wonderland", "Bob the Builder",
+                             "Charlie and the Chocolate Factory"};
+    CompressedBlock block;
+    assert(compressed_block_init(&block, block_entries, NULL, 3));
+    int stack[16];
+    assert(block.entries_n == 3);
+
+    const char *queries_may_match[] = {"wonder*land & !builder", "!zanzibar",
+                                       "zanzibar | bob", "^char*te", "/z|a/"};
+    for (size_t i = 0; i < 5; i++) {
+      TokenList *token_list = tokenize(queries_may_match[i]);
+      TokenList *pf_list = to_postfix_notation(token_list);
+      assert(compressed_block_may_match(&block, pf_list, stack));
+      TokenList *filters[] = {pf_list};
+      FilterBatch batch = {.filters = filters, .filters_n = 1};
+      assert(filter_batch_prepare(&batch, block.entries_n));
+      assert(compressed_blocks_search(&block, 1, &batch, false) != 0);
+      filter_batch_release(&batch);
+      token_list_destroy_shallow(pf_list);
+      token_list_destroy_deep(token_list);
+    }
+    const char *queries_no_match[] = {"zanzibar", "!(!zanzibar | z)",
+                                      "alice & wonder*zanzibar"};
+    for (size_t i = 0; i < 3; i++) {
+      TokenList *token_list = tokenize(queries_no_match[i]);
+      TokenList *pf_list = to_postfix_notation(token_list);
+      assert(!compressed_block_may_match(&block, pf_list, stack));
+      token_list_destroy_shallow(pf_list);
+      token_list_destroy_deep(token_list);
+    }
+    const char *queries_malformed[] = {"alice &", "!", "& | bob"};
+    for (size_t i = 0; i < 3; i++) {
+      TokenList *token_list = tokenize(queries_malformed[i]);
+      TokenList *pf_list = to_postfix_notation(token_list);
+      assert(!is_valid_postfix(pf_list));
+      assert(compressed_block_may_match(&block, pf_list, stack));
+      TokenList *filters[] = {pf_list};
+      FilterBatch batch = {.filters = filters, .filters_n = 1};
+      assert(!filter_batch_prepare(&batch, block.entries_n));
+      token_list_destroy_shallow(pf_list);
+      token_list_destroy_deep(token_list);
+    }
+    free(block.data);
+  }
+  {
+    compressed_mode = true;
+    const size_t added_n = 3 * COMPRESSED_BLOCK_ENTRIES_N + 5;
+    for (size_t i = 0; i < added_n; i++) {
+      char entry[32];
+      snprintf(entry, sizeof(entry), "entry %zu%s", i, i == 7 ? " Alice" : "");
+      storage_add(strdup(entry));
+    }
+    assert(blocks_n == 3);
+    assert(entries_n == 5);
+    assert(storage_entries_n() == added_n);
+
+    TokenList *token_list = tokenize("alice | entry 1");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    // entry 1, 10-19, 100-196 and entry 7 Alice
+    assert(storage_search(pf_list, false) == 1 + 10 + 97 + 1);
+
+    assert(storage_del(7)); // replaced by entry 196
+    assert(storage_search(pf_list, false) == 1 + 10 + 97);
+    for (size_t i = 0; i < 6; i++) {
+      assert(storage_del(0)); // the tail runs out, a block gets unpacked
+    }
+    assert(blocks_n == 2);
+    assert(storage_entries_n() == added_n - 7);
+    assert(!storage_del(added_n - 7));
+
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+    storage_destroy();
+    compressed_mode = false;
+  }
+  {
+    // a tail left longer than a block (e.g. after a failed seal) only
+    // gets its first COMPRESSED_BLOCK_ENTRIES_N entries sealed
+    const size_t added_n = COMPRESSED_BLOCK_ENTRIES_N + 5;
+    for (size_t i = 0; i < added_n; i++) {
+      char entry[32];
+      snprintf(entry, sizeof(entry), "entry %zu", i);
+      storage_add(strdup(entry));
+    }
+    compressed_mode = true;
+    storage_add(strdup("entry last"));
+    assert(blocks_n == 1);
+    assert(blocks[0].entries_n == COMPRESSED_BLOCK_ENTRIES_N);
+    assert(entries_n == 6);
+    assert(str_eq(entries[0], "entry 64"));
+    assert(str_eq(entries[5], "entry last"));
+    assert(entries[6] == NULL);
+
+    TokenList *token_list = tokenize("entry 6");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    // entry 6, 60-68
+    assert(storage_search(pf_list, false) == 1 + 9);
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+    storage_destroy();
+    compressed_mode = false;
+  }
+  {
+    const char *error;
+    unsigned char *document = document_from_text(
+        "{name: Alice, \"address\": {zip: \"10115\", city: Berlin}, age: 30}",
+        &error);
+    assert(document != NULL);
+    assert(document_fields_n(document) == 3);
+    assert(str_eq(document_key(document, 0), "address"));
+    assert(str_eq(document_key(document, 2), "name"));
+
+    const unsigned char *value = document_get_path(document, "address.city");
+    assert(value != NULL && *value == DOCUMENT_VALUE_STRING);
+    assert(str_eq(document_value_string(value), "Berlin"));
+    value = document_get_path(document, "address");
+    assert(value != NULL && *value == DOCUMENT_VALUE_DOCUMENT);
+    assert(document_get_path(document, "address.street") == NULL);
+    assert(document_get_path(document, "name.first") == NULL);
+    assert(document_get_path(document, "addres") == NULL);
+    free(document);
+
+    document = document_from_text("{}", &error);
+    assert(document != NULL && document_fields_n(document) == 0);
+    free(document);
+
+    assert(document_from_text("{name: Alice", &error) == NULL);
+    assert(document_from_text("{name: Alice, name: Bob}", &error) == NULL);
+    assert(document_from_text("{a.b: c}", &error) == NULL);
+    assert(document_from_text("{a: b} c", &error) == NULL);
+    assert(document_from_text("{a: \"b}", &error) == NULL);
+
+    for (size_t depth = DOCUMENT_MAX_DEPTH; depth <= DOCUMENT_MAX_DEPTH + 1;
+         depth++) {
+      char text[5 * (DOCUMENT_MAX_DEPTH + 1) + 3];
+      size_t len = 0;
+      text[len++] = '{';
+      for (size_t i = 0; i < depth; i++) {
+        memcpy(text + len, "a: {", 4);
+        len += 4;
+      }
+      memset(text + len, '}', depth + 1);
+      len += depth + 1;
+      text[len] = '\0';
+      document = document_from_text(text, &error);
+      assert((document != NULL) == (depth == DOCUMENT_MAX_DEPTH));
+      free(document);
+    }
+  }
+  {
+    // a scratch path of the encoded size fits every path, and removing
+    // the postings of an entry rolls back adding them
+    const char *error;
+    unsigned char *document =
+        document_from_text("{a: {bb: {c: d}}, e: f}", &error);
+    char *path = malloc(read_u32(document));
+    size_t entry_number = 5;
+    assert(path_index_update(document, path, path_index_add_posting,
+                             &entry_number));
+    PathPostings *postings = path_index_find("a.bb.c");
+    assert(postings != NULL && postings->postings_n == 1);
+    assert(postings->postings[0] == entry_number);
+    assert(path_index_find("e") != NULL);
+    assert(path_index_update(document, path, path_index_remove_posting,
+                             &entry_number));
+    assert(postings->postings_n == 0);
+    free(path);
+    free(document);
+    path_index_destroy();
+  }
+  {
+    TokenList *token_list =
+        tokenize("@address.city: Berlin & !@name:/^b/ | Berlin");
+    assert(token_list->tokens_n == 6);
+    assert(str_eq(token_list->tokens[0].path, "address.city"));
+    assert(str_eq(token_list->tokens[0].str, "Berlin"));
+    assert(str_eq(token_list->tokens[3].path, "name"));
+    assert(str_eq(token_list->tokens[3].str, "/^b/"));
+    assert(token_list->tokens[3].pattern != NULL);
+    assert(token_list->tokens[5].path == NULL);
+    token_list_destroy_deep(token_list);
+
+    assert(tokenize("@name: | Alice") == NULL);
+  }
+  {
+    // plain searches containing ':' still match as substrings
+    TokenList *token_list = tokenize("10:30 | Note: buy | http://x");
+    assert(token_list->tokens_n == 5);
+    assert(token_list->tokens[0].path == NULL);
+    assert(str_eq(token_list->tokens[2].str, "Note: buy"));
+    assert(token_list->tokens[2].path == NULL);
+    assert(str_eq(token_list->tokens[4].str, "http://x"));
+    TokenList *pf_list = to_postfix_notation(token_list);
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "meeting at 10:30"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "Note: buy milk"));
+    assert(eval_postfixed_tokens_as_predicate(pf_list, "see http://x.org"));
+    assert(!eval_postfixed_tokens_as_predicate(pf_list, "Note: sell"));
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+
+    assert(storage_add(strdup("meeting at 10:30")));
+    assert(storage_add(strdup("{note: \"buy: milk\"}")));
+    token_list = tokenize("10:30 | buy: milk");
+    pf_list = to_postfix_notation(token_list);
+    assert(storage_search(pf_list, false) == 2);
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+    storage_destroy();
+  }
+  {
+    compressed_mode = true;
+    const size_t added_n = COMPRESSED_BLOCK_ENTRIES_N + 3;
+    for (size_t i = 0; i < added_n; i++) {
+      char entry[64];
+      snprintf(entry, sizeof(entry), "{id: %zu, address: {city: %s}}", i,
+               i % 2 == 0 ? "Berlin" : "Paris");
+      assert(storage_add(strdup(entry)));
+    }
+    assert(storage_add(strdup("Berlin, but not a document")));
+    assert(!storage_add(strdup("{broken")));
+    assert(storage_entries_n() == added_n + 1);
+    // sealed documents are compressed along with their text
+    assert(blocks_n == 1 && entries_n == 4);
+    assert(blocks[0].documents_n == COMPRESSED_BLOCK_ENTRIES_N);
+    assert(blocks[0].raw_size > blocks[0].text_size);
+    assert(entry_documents[2] != NULL && entry_documents[3] == NULL);
+    assert(entry_documents[4] == NULL);
+
+    PathPostings *postings = path_index_find("address.city");
+    assert(postings != NULL && postings->postings_n == added_n);
+
+    TokenList *token_list = tokenize("@address.city:berlin & !@id:1");
+    TokenList *pf_list = to_postfix_notation(token_list);
+    bool *candidates = path_index_candidates(pf_list, storage_entries_n());
+    assert(candidates != NULL);
+    assert(candidates[0] && !candidates[added_n]);
+    free(candidates);
+    // even ids up to 66, except 10, 12, 14, 16, 18
+    assert(storage_search(pf_list, false) == 34 - 5);
+
+    assert(storage_del(0)); // replaced by the plain string
+    assert(storage_search(pf_list, false) == 34 - 5 - 1);
+    assert(storage_del(0));
+    assert(storage_del(2)); // replaced by id 65
+    assert(postings->postings_n == added_n - 2);
+    assert(storage_search(pf_list, false) == 34 - 5 - 2);
+
+    TokenList *token_list_plain = tokenize("@id:/^6[0-9]$/");
+    TokenList *pf_list_plain = to_postfix_notation(token_list_plain);
+    assert(storage_search(pf_list_plain, false) == 7);
+
+    token_list_destroy_shallow(pf_list_plain);
+    token_list_destroy_deep(token_list_plain);
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+    storage_destroy();
+    compressed_mode = false;
+  }
+  {
+    JsonLexer lexer = {.s = " {\"a\\\"\\u00e9\\ud83d\\ude00\": "
+                            "[-1.5e3, true, null]}"};
+    const JsonTokenType expected[] = {
+        JSON_TOKEN_BEGIN_OBJECT, JSON_TOKEN_STRING, JSON_TOKEN_COLON,
+        JSON_TOKEN_BEGIN_ARRAY,  JSON_TOKEN_NUMBER, JSON_TOKEN_COMMA,
+        JSON_TOKEN_TRUE,         JSON_TOKEN_COMMA,  JSON_TOKEN_NULL,
+        JSON_TOKEN_END_ARRAY,    JSON_TOKEN_END_OBJECT, JSON_TOKEN_END};
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+      assert(json_lexer_next(&lexer));
+      assert(lexer.type == expected[i]);
+      if (lexer.type == JSON_TOKEN_STRING) {
+        assert(str_eq(lexer.text, "a\"\xc3\xa9\xf0\x9f\x98\x80"));
+      } else if (lexer.type == JSON_TOKEN_NUMBER) {
+        assert(str_eq(lexer.text, "-1.5e3"));
+      }
+    }
+    const char *malformed[] = {"\"abc", "\"\\x\"", "\"\\ud83d\"", "01",
+                               "-", "tru", "@"};
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+      lexer.s = malformed[i];
+      assert(!json_lexer_next(&lexer));
+    }
+    free(lexer.text);
+  }
+  {
+    FilterBatch batch = {0};
+    assert(filter_batch_compile(
+        &batch, "{\"name\": \"alice\", \"$or\": [{\"address\": {\"city\": "
+                "{\"$in\": [\"Berlin\", \"Rome\"]}}}, {\"$not\": {\"age\": "
+                "{\"$exists\": true}}}]}"));
+    assert(batch.filters_n == 1);
+    // name:^alice$ address.city:^Berlin$ address.city:^Rome$ |
+    // age:$exists ! | &
+    TokenList *pf_list = batch.filters[0];
+    assert(pf_list->tokens_n == 8);
+    assert(str_eq(pf_list->tokens[0].path, "name"));
+    assert(str_eq(pf_list->tokens[0].str, "^alice$"));
+    assert(str_eq(pf_list->tokens[1].path, "address.city"));
+    assert(str_eq(pf_list->tokens[1].str, "^Berlin$"));
+    assert(pf_list->tokens[3].type == TOKEN_TYPE_OP_OR);
+    assert(str_eq(pf_list->tokens[4].path, "age"));
+    assert(pf_list->tokens[4].exists);
+    assert(pf_list->tokens[5].type == TOKEN_TYPE_OP_NOT);
+    assert(pf_list->tokens[6].type == TOKEN_TYPE_OP_OR);
+    assert(pf_list->tokens[7].type == TOKEN_TYPE_OP_AND);
+
+    const char *error;
+    unsigned char *document =
+        document_from_text("{name: Alice, address: {city: berlin}}", &error);
+    assert(eval_postfixed_tokens_on_entry(pf_list, "", document, NULL));
+    free(document);
+    document = document_from_text(
+        "{name: Alice, age: 30, address: {city: Berlin-Mitte}}", &error);
+    assert(!eval_postfixed_tokens_on_entry(pf_list, "", document, NULL));
+    free(document);
+    document = document_from_text("{name: Malice}", &error);
+    assert(!eval_postfixed_tokens_on_entry(pf_list, "", document, NULL));
+    free(document);
+    document = document_from_text("{name: ALICE}", &error);
+    assert(eval_postfixed_tokens_on_entry(pf_list, "", document, NULL));
+    free(document);
+    filter_batch_destroy(&batch);
+  }
+  {
+    // $exists also holds for nested documents
+    FilterBatch batch = {0};
+    assert(filter_batch_compile(
+        &batch, "[{\"address\": {\"$exists\": true}}, "
+                "{\"address\": {\"$exists\": false}}]"));
+    assert(batch.leaves_n == 1);
+    assert(storage_add(strdup("{name: Alice, address: {city: Berlin}}")));
+    assert(storage_add(strdup("{name: Bob, address: {}}")));
+    assert(storage_add(strdup("{name: Carol}")));
+    assert(storage_add(strdup("address unknown")));
+    PathPostings *postings = path_index_find("address");
+    assert(postings != NULL && postings->postings_n == 2);
+    assert(filter_batch_prepare(&batch, storage_entries_n()));
+    assert(storage_search_batch(&batch, false) == 4);
+    assert(batch.matches_n[0] == 2);
+    assert(batch.matches_n[1] == 2);
+    filter_batch_destroy(&batch);
+    storage_destroy();
+  }
+  {
+    const char *malformed[] = {
+        "",
+        "[]",
+        "{\"name\" \"alice\"}",
+        "{\"name\": \"alice\"} {}",
+        "{\"$eq\": \"alice\"}",
+        "{\"name\": {\"$unknown\": 1}}",
+        "{\"name\": true}",
+        "{\"name\": {\"$regex\": \"a(b\"}}",
+        "{\"$or\": {\"name\": \"alice\"}}",
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+      FilterBatch batch = {0};
+      assert(!filter_batch_compile(&batch, malformed[i]));
+      filter_batch_destroy(&batch);
+    }
+  }
+  {
+    // the filter nesting limit rejects deep $not chains without recursing on
+    char filter[16 * (FILTER_MAX_DEPTH + 1) + 16];
+    for (int depth = FILTER_MAX_DEPTH; depth <= FILTER_MAX_DEPTH + 1;
+         depth++) {
+      char *p = filter;
+      for (int i = 1; i < depth; i++)
+        p += sprintf(p, "{\"$not\": ");
+      p += sprintf(p, "{\"a\": 1}");
+      for (int i = 1; i < depth; i++)
+        *p++ = '}';
+      *p = '\0';
+      FilterBatch batch = {0};
+      assert(filter_batch_compile(&batch, filter) ==
+             (depth == FILTER_MAX_DEPTH));
+      filter_batch_destroy(&batch);
+    }
+  }
+  {
+    storage_add(strdup("{name: Alice, address: {city: Berlin}, id: 1}"));
+    storage_add(strdup("{name: Bob, address: {city: Paris}, id: 2}"));
+    storage_add(strdup("{name: Charlie, address: {city: Berlin}, id: 3}"));
+    storage_add(strdup("Dan from Berlin"));
+
+    FilterBatch batch = {0};
+    assert(filter_batch_compile(
+        &batch, "[{\"address.city\": \"berlin\"}, {\"$or\": [{\"address\": "
+                "{\"city\": \"berlin\"}}, {\"id\": 2}]}, {}, {\"$and\": [], "
+                "\"$text\": \"berlin\"}, {\"$or\": []}]"));
+    assert(batch.filters_n == 5);
+    // address.city:^berlin$ is shared by the first two filters
+    assert(batch.leaves_n == 3);
+    assert(batch.filters[0]->tokens[0].str == batch.filters[1]->tokens[0].str);
+
+    assert(filter_batch_prepare(&batch, storage_entries_n()));
+    assert(storage_search_batch(&batch, false) == 4);
+    assert(batch.matches_n[0] == 2);
+    assert(batch.matches_n[1] == 3);
+    assert(batch.matches_n[2] == 4);
+    assert(batch.matches_n[3] == 3);
+    assert(batch.matches_n[4] == 0);
+    filter_batch_destroy(&batch);
+    storage_destroy();
+  }
   printf("\x1b[32m"); // green text
   printf("\u2713 ");  // Unicode check mark
   printf("\x1b[0m");  // Reset text color to default
   printf("All tests passed\n");
 }
 
+#define BENCHMARK_ENTRIES_N 100000
+
+unsigned int benchmark_random(unsigned int *seed, unsigned int n) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) % n;
+}
+
+double seconds_since(struct timespec start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void run_benchmark(void) {
+  const char *const names[] = {"Alice", "Bob", "Charlie", "Dan", "Eve"};
+  const char *const cities[] = {"Berlin", "Paris", "London", "Madrid", "Rome"};
+  const char *const items[] = {"laptop", "phone", "tablet", "monitor"};
+  const char *const statuses[] = {"delivered", "shipped", "pending",
+                                  "cancelled"};
+  const char *const queries[] = {
+      "Berlin & laptop",
+      "/^order #[0-9]*7: eve/",
+      "!delivered & !shipped",
+      "Zanzibar",
+      "Charlie & Rome & cancelled & monitor",
+  };
+
+  char **bench_entries = calloc(BENCHMARK_ENTRIES_N, sizeof(char *));
+  size_t bench_blocks_n =
+      (BENCHMARK_ENTRIES_N + COMPRESSED_BLOCK_ENTRIES_N - 1) /
+      COMPRESSED_BLOCK_ENTRIES_N;
+  CompressedBlock *bench_blocks =
+      calloc(bench_blocks_n, sizeof(CompressedBlock));
+  if (bench_entries == NULL || bench_blocks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for benchmark!\n");
+    goto cleanup;
+  }
+
+  unsigned int seed = 42;
+  size_t raw_size = 0;
+  for (size_t i = 0; i < BENCHMARK_ENTRIES_N; i++) {
+    char entry[256];
+    snprintf(entry, sizeof(entry),
+             "Order #%zu: %s from %s bought %u x %s, status: %s", i,
+             names[benchmark_random(&seed, 5)],
+             cities[benchmark_random(&seed, 5)],
+             1 + benchmark_random(&seed, 9),
+             items[benchmark_random(&seed, 4)],
+             statuses[benchmark_random(&seed, 4)]);
+    bench_entries[i] = strdup(entry);
+    if (bench_entries[i] == NULL) {
+      fprintf(stderr, "Failed to allocate memory for benchmark entry!\n");
+      goto cleanup;
+    }
+    raw_size += strlen(entry) + 1;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t stored_size = 0;
+  for (size_t i = 0; i < bench_blocks_n; i++) {
+    size_t first = i * COMPRESSED_BLOCK_ENTRIES_N;
+    size_t n = BENCHMARK_ENTRIES_N - first < COMPRESSED_BLOCK_ENTRIES_N
+                   ? BENCHMARK_ENTRIES_N - first
+                   : COMPRESSED_BLOCK_ENTRIES_N;
+    if (!compressed_block_init(&bench_blocks[i], bench_entries + first, NULL,
+                               n)) {
+      goto cleanup;
+    }
+    stored_size += bench_blocks[i].data_size + sizeof(bench_blocks[i].summary);
+  }
+  double compress_seconds = seconds_since(start);
+
+  printf("%zu entries, %zu per block\n", (size_t)BENCHMARK_ENTRIES_N,
+         (size_t)COMPRESSED_BLOCK_ENTRIES_N);
+  printf("%-14s %14s %8s\n", "mode", "stored bytes", "ratio");
+  printf("%-14s %14zu %8.2f\n", "uncompressed", raw_size, 1.0);
+  printf("%-14s %14zu %8.2f (compressed at %.1f MB/s)\n", "compressed",
+         stored_size, (double)raw_size / stored_size,
+         raw_size / compress_seconds / 1e6);
+  printf("\n%-38s %8s %18s %18s\n", "query", "matches", "uncompressed MB/s",
+         "compressed MB/s");
+
+  for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+    TokenList *token_list = tokenize(queries[q]);
+    TokenList *pf_list = to_postfix_notation(token_list);
+    if (pf_list == NULL) {
+      token_list_destroy_deep(token_list);
+      goto cleanup;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t matches_n = 0;
+    for (size_t i = 0; i < BENCHMARK_ENTRIES_N; i++) {
+      if (eval_postfixed_tokens_as_predicate(pf_list, bench_entries[i])) {
+        matches_n++;
+      }
+    }
+    double uncompressed_seconds = seconds_since(start);
+
+    TokenList *filters[] = {pf_list};
+    FilterBatch batch = {.filters = filters, .filters_n = 1};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t compressed_matches_n = 0;
+    if (filter_batch_prepare(&batch, BENCHMARK_ENTRIES_N)) {
+      compressed_matches_n =
+          compressed_blocks_search(bench_blocks, bench_blocks_n, &batch, false);
+      filter_batch_release(&batch);
+    }
+    double compressed_seconds = seconds_since(start);
+    assert(matches_n == compressed_matches_n);
+
+    printf("%-38s %8zu %18.1f %18.1f\n", queries[q], matches_n,
+           raw_size / uncompressed_seconds / 1e6,
+           raw_size / compressed_seconds / 1e6);
+
+    token_list_destroy_shallow(pf_list);
+    token_list_destroy_deep(token_list);
+  }
+
+cleanup:
+  if (bench_entries != NULL) {
+    for (size_t i = 0; i < BENCHMARK_ENTRIES_N; i++) {
+      free(bench_entries[i]);
+    }
+  }
+  if (bench_blocks != NULL) {
+    for (size_t i = 0; i < bench_blocks_n; i++) {
+      free(bench_blocks[i].data);
+    }
+  }
+  free(bench_entries);
+  free(bench_blocks);
+  free(block_buffer);
+  block_buffer = NULL;
+  block_buffer_cap = 0;
+}
+
 int process_user_input(const char *const input) {
   if (*input == '\0') {
     return 0;
@@ -598,12 +4403,14 @@ int process_user_input(const char *const input) {
     puts("Available commands:");
     print_help_command('a', "add", "Add an entry");
     print_help_command('d', "del", "Delete an entry");
+    print_help_command('f', "find", "Find entries by a JSON filter");
     print_help_command('h', "help", "Read this help");
     print_help_command('l', "list", "List all entries");
     print_help_command('s', "search", "Search for an entry");
+    print_help_command('t', "stats", "Show storage statistics");
     print_help_command('q', "quit", "Quit the application");
   } else if (str_eq(input, "add") || str_eq(input, "a")) {
-    if (entries_n == MAX_ENTRIES_N) {
+    if (storage_is_full()) {
       puts("Maximum number of entries reached! Will not add more.");
       return 0;
     }
@@ -619,9 +4426,9 @@ int process_user_input(const char *const input) {
     if (end != NULL) {
       *end = '\0';
     }
-    entries[entries_n++] = entry;
+    storage_add(entry);
   } else if (str_eq(input, "del") || str_eq(input, "d")) {
-    if (entries_n == 0) {
+    if (storage_entries_n() == 0) {
       puts("No entries to delete!");
       return 0;
     }
@@ -637,19 +4444,16 @@ int process_user_input(const char *const input) {
     while ((c = getchar()) != '\n' && c != EOF)
       ;
 
-    if (entry_number >= entries_n) {
+    if (entry_number >= storage_entries_n()) {
       fprintf(stderr, "Entry number out of range!\n");
       return 0;
     }
-    free(entries[entry_number]);
-    entries[entry_number] = entries[entries_n - 1];
-    entries[entries_n - 1] = NULL;
-    entries_n--;
-  } else if (str_eq(input, "list") || str_eq(input, "l")) {
-    for (size_t i = 0; i < entries_n; i++) {
-      printf("%zu) %s\n", i, entries[i]);
+    if (!storage_del(entry_number)) {
+      fprintf(stderr, "Failed to delete entry! Try again\n");
     }
-    switch (entries_n) {
+  } else if (str_eq(input, "list") || str_eq(input, "l")) {
+    storage_list();
+    switch (storage_entries_n()) {
     case 0:
       puts("No entries yet!");
       break;
@@ -657,7 +4461,7 @@ int process_user_input(const char *const input) {
       puts("Total: 1 entry");
       break;
     default:
-      printf("Total: %zu entries\n", entries_n);
+      printf("Total: %zu entries\n", storage_entries_n());
     }
   } else if (str_eq(input, "search") || str_eq(input, "s")) {
     printf("Search: ");
@@ -674,14 +4478,47 @@ int process_user_input(const char *const input) {
     }
 
     TokenList *token_list = tokenize(pattern);
-    TokenList *pf_list = to_postfix_notation(token_list);
-    for (size_t i = 0; i < entries_n; i++) {
-      if (eval_postfixed_tokens_as_predicate(pf_list, entries[i])) {
-        printf("%zu) %s\n", i, entries[i]);
-      }
+    free(pattern);
+    if (token_list == NULL) {
+      return 0;
     }
+    TokenList *pf_list = to_postfix_notation(token_list);
+    storage_search(pf_list, true);
     token_list_destroy_shallow(pf_list);
     token_list_destroy_deep(token_list);
+  } else if (str_eq(input, "find") || str_eq(input, "f") ||
+             strncmp(input, "find ", 5) == 0 || strncmp(input, "f ", 2) == 0) {
+    // the filter may follow the command on the same line
+    const char *filter = strchr(input, ' ');
+    char *line = NULL;
+    if (filter == NULL) {
+      printf("Filter: ");
+      size_t line_initial_size = 256;
+      line = malloc(line_initial_size);
+      if (getline(&line, &line_initial_size, stdin) == -1) {
+        free(line);
+        fprintf(stderr, "Failed to read filter! Try again\n");
+        return 0;
+      }
+      char *end = strchr(line, '\n');
+      if (end != NULL) {
+        *end = '\0';
+      }
+      filter = line;
+    }
+
+    FilterBatch batch = {0};
+    if (filter_batch_compile(&batch, filter) &&
+        filter_batch_prepare(&batch, storage_entries_n())) {
+      storage_search_batch(&batch, true);
+      for (size_t i = 0; batch.filters_n > 1 && i < batch.filters_n; i++) {
+        printf("Filter %zu: %zu matches\n", i, batch.matches_n[i]);
+      }
+    }
+    filter_batch_destroy(&batch);
+    free(line);
+  } else if (str_eq(input, "stats") || str_eq(input, "t")) {
+    storage_print_stats();
   } else if (str_eq(input, "quit") || str_eq(input, "q")) {
     return 1;
   } else {
@@ -696,13 +4533,23 @@ int main(int argc, char *argv[]) {
       puts("Usage:");
       print_help_command('h', "--help", "Display this help message");
       print_help_command('t', "--test", "Run tests");
+      print_help_command('b', "--bench", "Benchmark compressed storage");
+      print_help_command('c', "--compressed", "Keep entries compressed");
       return EXIT_SUCCESS;
     }
     if (str_eq(argv[1], "--test") || str_eq(argv[1], "-t")) {
       run_tests();
       return EXIT_SUCCESS;
     }
-    return EXIT_FAILURE;
+    if (str_eq(argv[1], "--bench") || str_eq(argv[1], "-b")) {
+      run_benchmark();
+      return EXIT_SUCCESS;
+    }
+    if (str_eq(argv[1], "--compressed") || str_eq(argv[1], "-c")) {
+      compressed_mode = true;
+    } else {
+      return EXIT_FAILURE;
+    }
   }
 
   puts("Welcome to monco! Type 'help' for help.");
@@ -721,9 +4568,7 @@ int main(int argc, char *argv[]) {
       break;
     }
   }
-  for (size_t i = 0; i < MAX_ENTRIES_N; i++) {
-    free(entries[i]);
-  }
+  storage_destroy();
   puts("Bye!");
   free(input);
 